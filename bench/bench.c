@@ -0,0 +1,164 @@
+/*
+ * bench.c — throughput harness for `make bench`
+ *
+ * Usage: bench [-n RUNS] [-a ARG]... MDCAT FILE...
+ *
+ * Runs MDCAT [ARG...] FILE for every file (best of RUNS, default 3) with
+ * the output going into a pipe that is drained here, and reports:
+ *   MB/s, lines/s   input size and line count over wall-clock time
+ *   peak RSS        maximum resident set of the mdcat process
+ *   first           time until the first output line arrived
+ *   max gap         longest stretch without a new output line, i.e. the
+ *                   worst per-line latency a reader of the pipe sees
+ */
+
+#define _DEFAULT_SOURCE   /* wait4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 32
+
+typedef struct {
+    double wall;      /* seconds */
+    double first;     /* seconds until the first '\n' */
+    double max_gap;   /* seconds */
+    long   rss_kb;
+} Run;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Count the lines of `path` and return its size in bytes (-1 on error). */
+static long long scan_input(const char *path, long long *lines)
+{
+    static char buf[1 << 16];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    long long size = 0;
+    ssize_t   n;
+    *lines = 0;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        size += n;
+        for (const char *p = buf; (p = memchr(p, '\n', (size_t)(buf + n - p))); p++)
+            (*lines)++;
+    }
+    close(fd);
+    return size;
+}
+
+static int run_once(char **argv, Run *r)
+{
+    static char buf[1 << 16];
+    int p[2];
+    if (pipe(p) < 0) return -1;
+
+    double start = now();
+    pid_t  pid   = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        dup2(devnull, STDIN_FILENO);
+        dup2(p[1], STDOUT_FILENO);
+        close(p[0]);
+        close(p[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(p[1]);
+
+    double last = start;
+    r->first   = -1;
+    r->max_gap = 0;
+    for (;;) {
+        ssize_t n = read(p[0], buf, sizeof buf);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (!memchr(buf, '\n', (size_t)n)) continue;
+        double t = now();
+        if (r->first < 0) r->first = t - start;
+        if (t - last > r->max_gap) r->max_gap = t - last;
+        last = t;
+    }
+    close(p[0]);
+
+    int           status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) return -1;
+    r->wall   = now() - start;
+    r->rss_kb = ru.ru_maxrss;
+    if (r->first < 0) r->first = r->wall;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void usage(void)
+{
+    fputs("usage: bench [-n RUNS] [-a ARG]... MDCAT FILE...\n", stderr);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char *args[MAX_ARGS + 3];
+    int   nargs = 1;
+    int   runs  = 3;
+    int   i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1) usage();
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc && nargs < MAX_ARGS) {
+            args[nargs++] = argv[++i];
+        } else {
+            usage();
+        }
+    }
+    if (argc - i < 2) usage();
+    args[0] = argv[i++];
+
+    printf("%-16s %8s %9s %11s %12s %9s %9s\n",
+           "corpus", "MB", "MB/s", "lines/s", "peak RSS", "first", "max gap");
+
+    int rc = 0;
+    for (; i < argc; i++) {
+        const char *path = argv[i];
+        const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        long long   lines;
+        long long   size = scan_input(path, &lines);
+        Run         best = { 0 }, r;
+
+        if (size < 0) { perror(path); rc = 1; continue; }
+
+        args[nargs]     = (char *)path;
+        args[nargs + 1] = NULL;
+        for (int k = 0; k < runs; k++) {
+            if (run_once(args, &r) < 0) {
+                fprintf(stderr, "bench: %s failed on %s\n", args[0], path);
+                return 1;
+            }
+            if (k == 0 || r.wall < best.wall) best = r;
+        }
+
+        double mb = (double)size / (1024.0 * 1024.0);
+        printf("%-16s %8.1f %9.1f %11.0f %8.1f MiB %6.1f ms %6.1f ms\n",
+               name, mb, mb / best.wall, (double)lines / best.wall,
+               (double)best.rss_kb / 1024.0, best.first * 1e3, best.max_gap * 1e3);
+    }
+    return rc;
+}
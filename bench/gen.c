@@ -0,0 +1,237 @@
+/*
+ * gen.c — synthetic Markdown corpora for `make bench`
+ *
+ * Usage: gen KIND MEGABYTES > file.md
+ *
+ * Kinds:
+ *   para       paragraphs with inline markup, headings, lists and quotes
+ *   table      many small tables
+ *   fence      fenced code blocks between short paragraphs
+ *   longline   very long paragraph lines (64 KiB - 1 MiB each)
+ *   hugetable  a single table with one row per line
+ *   utf8       multi-byte text (Latin, CJK, symbols) with markup
+ *   unmatched  long lines full of delimiters that never close (`, *, _, [)
+ *   badutf8    utf8 text broken by stray, overlong, surrogate and truncated
+ *              sequences
+ *
+ * Output is deterministic so runs are comparable across builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long g_rng = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64: fast, reproducible, good enough for filler text */
+static unsigned rnd(unsigned n)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return (unsigned)(g_rng % n);
+}
+
+static const char *const ascii_words[] = {
+    "alpha", "beta", "gamma", "delta", "render", "buffer", "terminal",
+    "column", "width", "markdown", "stream", "latency", "the", "of", "and",
+    "to", "in", "is", "for", "with", "throughput", "release", "notes",
+};
+
+static const char *const utf8_words[] = {
+    "café", "naïve", "Zürich", "façade", "日本語", "中文", "한국어",
+    "✓", "→", "▶", "Ελληνικά", "Кириллица", "emoji😀", "ß", "œuvre",
+};
+
+#define NWORDS(a) (sizeof(a) / sizeof((a)[0]))
+
+static long long g_left;   /* bytes still to write */
+
+static void emit(const char *s)
+{
+    size_t n = strlen(s);
+    fwrite(s, 1, n, stdout);
+    g_left -= (long long)n;
+}
+
+/* One word, sometimes wrapped in inline markup */
+static void word(const char *const *words, size_t nwords, int markup)
+{
+    const char *w = words[rnd((unsigned)nwords)];
+    unsigned    m = markup ? rnd(20) : 0;
+
+    if      (m == 0) { emit("**"); emit(w); emit("**"); }
+    else if (m == 1) { emit("*");  emit(w); emit("*"); }
+    else if (m == 2) { emit("`");  emit(w); emit("`"); }
+    else             { emit(w); }
+}
+
+static void sentence(const char *const *words, size_t nwords, int n, int markup)
+{
+    for (int i = 0; i < n; i++) {
+        if (i) emit(" ");
+        word(words, nwords, markup);
+    }
+}
+
+static void gen_para(void)
+{
+    unsigned k = rnd(12);
+    if (k == 0) {
+        emit("## "); sentence(ascii_words, NWORDS(ascii_words), 4, 1); emit("\n\n");
+    } else if (k == 1) {
+        for (int i = 0; i < 4; i++) {
+            emit("- "); sentence(ascii_words, NWORDS(ascii_words), 8, 1); emit("\n");
+        }
+        emit("\n");
+    } else if (k == 2) {
+        emit("> "); sentence(ascii_words, NWORDS(ascii_words), 12, 1); emit("\n\n");
+    } else {
+        for (int i = 0; i < 4; i++) {
+            sentence(ascii_words, NWORDS(ascii_words), 14, 1); emit("\n");
+        }
+        emit("\n");
+    }
+}
+
+static void table_row(int ncols, const char *const *words, size_t nwords)
+{
+    char num[32];
+    emit("|");
+    for (int c = 0; c < ncols; c++) {
+        emit(" ");
+        if (c == 0) { sprintf(num, "%u", rnd(100000)); emit(num); }
+        else        sentence(words, nwords, 1 + (int)rnd(3), 1);
+        emit(" |");
+    }
+    emit("\n");
+}
+
+static void table_head(int ncols)
+{
+    emit("|");
+    for (int c = 0; c < ncols; c++) {
+        emit(" "); word(ascii_words, NWORDS(ascii_words), 0); emit(" |");
+    }
+    emit("\n|");
+    for (int c = 0; c < ncols; c++)
+        emit(c == 0 ? "---:|" : (c % 2 ? ":---|" : ":---:|"));
+    emit("\n");
+}
+
+static void gen_table(void)
+{
+    int ncols = 2 + (int)rnd(5);
+    int nrows = 5 + (int)rnd(16);
+
+    table_head(ncols);
+    for (int r = 0; r < nrows; r++)
+        table_row(ncols, ascii_words, NWORDS(ascii_words));
+    emit("\n");
+}
+
+static void gen_fence(void)
+{
+    static const char *const code[] = {
+        "int main(int argc, char **argv) {",
+        "    for (size_t i = 0; i < n; i++) sum += a[i] * *b++;",
+        "    return render_file(fp, \"**not bold**\", `x`);",
+        "}",
+        "def handler(event, _context):",
+        "    return {\"status\": 200, \"body\": json.dumps(event)}",
+    };
+    emit("```c\n");
+    for (int i = 0, n = 8 + (int)rnd(24); i < n; i++) {
+        emit(code[rnd((unsigned)NWORDS(code))]); emit("\n");
+    }
+    emit("```\n\n");
+    sentence(ascii_words, NWORDS(ascii_words), 10, 1);
+    emit("\n\n");
+}
+
+static void gen_longline(void)
+{
+    long long n = 64 * 1024 + (long long)rnd(960 * 1024);
+    long long stop = g_left - n;
+    while (g_left > stop && g_left > 0) {
+        word(ascii_words, NWORDS(ascii_words), 1);
+        emit(" ");
+    }
+    emit("\n\n");
+}
+
+static void gen_utf8(void)
+{
+    if (rnd(10) == 0) {
+        emit("### "); sentence(utf8_words, NWORDS(utf8_words), 3, 1); emit("\n\n");
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        sentence(utf8_words, NWORDS(utf8_words), 12, 1); emit("\n");
+    }
+    emit("\n");
+}
+
+static void gen_unmatched(void)
+{
+    static const char *const delims[] = { "`", "*", "_", "**", "[", "![", "`` " };
+    const char *d    = delims[rnd((unsigned)NWORDS(delims))];
+    long long   n    = 64 * 1024 + (long long)rnd(192 * 1024);
+    long long   stop = g_left - n;
+    while (g_left > stop && g_left > 0) {
+        emit(d);
+        word(ascii_words, NWORDS(ascii_words), 0);
+        emit(" ");
+    }
+    emit("\n\n");
+}
+
+static void gen_badutf8(void)
+{
+    static const char *const bad[] = {
+        "\xff", "\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+        "\xe6\x97", "\x80",
+    };
+    for (int i = 0; i < 4; i++) {
+        sentence(utf8_words, NWORDS(utf8_words), 8, 1);
+        emit(" ");
+        emit(bad[rnd((unsigned)NWORDS(bad))]);
+        if (rnd(2)) { emit(" "); word(utf8_words, NWORDS(utf8_words), 1); }
+        emit("\n");
+    }
+    emit("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fputs("usage: gen para|table|fence|longline|hugetable|utf8|unmatched|badutf8"
+              " MEGABYTES\n", stderr);
+        return 2;
+    }
+    const char *kind = argv[1];
+    g_left = atoll(argv[2]) * 1024 * 1024;
+
+    if (strcmp(kind, "hugetable") == 0) {
+        table_head(6);
+        while (g_left > 0) table_row(6, ascii_words, NWORDS(ascii_words));
+        return 0;
+    }
+
+    void (*block)(void) =
+        strcmp(kind, "para")      == 0 ? gen_para      :
+        strcmp(kind, "table")     == 0 ? gen_table     :
+        strcmp(kind, "fence")     == 0 ? gen_fence     :
+        strcmp(kind, "longline")  == 0 ? gen_longline  :
+        strcmp(kind, "utf8")      == 0 ? gen_utf8      :
+        strcmp(kind, "unmatched") == 0 ? gen_unmatched :
+        strcmp(kind, "badutf8")   == 0 ? gen_badutf8   : NULL;
+    if (!block) {
+        fprintf(stderr, "gen: unknown kind '%s'\n", kind);
+        return 2;
+    }
+
+    emit("# Synthetic corpus\n\n");
+    while (g_left > 0) block();
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * startup.c — per-invocation latency harness for `make bench-startup`
+ *
+ * Usage: startup [-n RUNS] [-a ARG]... FILE MDCAT...
+ *
+ * Runs every MDCAT [ARG...] FILE RUNS times (default 1000), interleaved so
+ * that noise hits all binaries alike, with the output going into a pipe
+ * that is drained here.  For each binary it reports the file size and the
+ * minimum, median and 99th percentile of the time from spawn to exit,
+ * which for a small FILE is almost all process startup.
+ */
+
+#define _DEFAULT_SOURCE   /* posix_spawn() file actions */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 32
+#define MAX_BINS 8
+
+extern char **environ;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Seconds for one run of argv, or -1 when it could not run or failed */
+static double run_once(char **argv)
+{
+    static char buf[1 << 16];
+    posix_spawn_file_actions_t fa;
+    int   p[2];
+    pid_t pid;
+
+    if (pipe(p) < 0) return -1;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, p[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&fa, p[0]);
+    posix_spawn_file_actions_addclose(&fa, p[1]);
+
+    double start = now();
+    int    err   = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(p[1]);
+    if (err) { close(p[0]); errno = err; return -1; }
+
+    for (;;) {
+        ssize_t n = read(p[0], buf, sizeof buf);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    close(p[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) return -1;
+    double t = now() - start;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? t : -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+    fputs("usage: startup [-n RUNS] [-a ARG]... FILE MDCAT...\n", stderr);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char *args[MAX_ARGS + 3];
+    int   nargs = 1;
+    int   runs  = 1000;
+    int   i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1) usage();
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc && nargs < MAX_ARGS) {
+            args[nargs++] = argv[++i];
+        } else {
+            usage();
+        }
+    }
+    if (argc - i < 2 || argc - i - 1 > MAX_BINS) usage();
+    const char *file = argv[i++];
+    int         nbin = argc - i;
+    char      **bins = argv + i;
+    double     *t    = malloc(sizeof *t * (size_t)runs * (size_t)nbin);
+    if (!t) { perror("startup"); return 1; }
+
+    args[nargs]     = (char *)file;
+    args[nargs + 1] = NULL;
+    for (int k = 0; k < runs; k++) {
+        for (int b = 0; b < nbin; b++) {
+            args[0] = bins[b];
+            double s = run_once(args);
+            if (s < 0) {
+                fprintf(stderr, "startup: %s failed on %s\n", bins[b], file);
+                return 1;
+            }
+            t[(size_t)b * (size_t)runs + (size_t)k] = s;
+        }
+    }
+
+    printf("%-24s %9s %9s %9s %9s\n", "binary", "size", "min", "median", "p99");
+    for (int b = 0; b < nbin; b++) {
+        double     *r = t + (size_t)b * (size_t)runs;
+        struct stat st;
+        qsort(r, (size_t)runs, sizeof *r, cmp_double);
+        printf("%-24s %5lld KiB %6.0f us %6.0f us %6.0f us\n", bins[b],
+               stat(bins[b], &st) == 0 ? (long long)st.st_size / 1024 : -1LL,
+               r[0] * 1e6, r[runs / 2] * 1e6, r[(size_t)runs * 99 / 100] * 1e6);
+    }
+    free(t);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * differ.c — differential check of two mdcat builds for `make differ`
+ *
+ * Usage: differ [-a ARG]... [-x FACTOR] [-t SECONDS] MDCAT REF FILE...
+ *
+ * Runs MDCAT [ARG...] FILE and REF [ARG...] FILE for every file, checks
+ * that both write the same bytes and exit the same way, and prints each
+ * input's timings.  Inputs are marked
+ *   DIFF     the outputs or exit statuses differ
+ *   TIMEOUT  either build ran longer than SECONDS (default 10)
+ *   SLOW     MDCAT took FACTOR (default 4) times as long as REF, or took
+ *            FACTOR times the median time per byte of all inputs; the
+ *            latter catches inputs that are quadratic in both builds.
+ *            Runs under 10 ms and inputs under 64 KiB are not judged.
+ * Exits 1 if an input is marked DIFF or TIMEOUT.
+ */
+
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS  32
+#define MIN_WALL  0.010
+#define MIN_SIZE  (64 * 1024)
+
+typedef struct {
+    char  *buf;
+    size_t len, cap;
+} Buf;
+
+typedef struct {
+    const char *path;
+    long long   size;
+    double      wall[2];    /* MDCAT, REF */
+    int         diff, timeout;
+} Result;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Run argv with its output collected in out; returns the wait status or -1. */
+static int run_once(char **argv, unsigned timeout, Buf *out, double *wall)
+{
+    int p[2];
+    if (pipe(p) < 0) return -1;
+
+    double start = now();
+    pid_t  pid   = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        dup2(devnull, STDIN_FILENO);
+        dup2(p[1], STDOUT_FILENO);
+        close(p[0]);
+        close(p[1]);
+        alarm(timeout);   /* survives execv() and ends the run */
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(p[1]);
+
+    out->len = 0;
+    for (;;) {
+        if (out->cap - out->len < 65536) {
+            out->cap = out->cap ? out->cap * 2 : 1 << 20;
+            if (!(out->buf = realloc(out->buf, out->cap))) {
+                fputs("differ: out of memory\n", stderr);
+                exit(1);
+            }
+        }
+        ssize_t n = read(p[0], out->buf + out->len, out->cap - out->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += (size_t)n;
+    }
+    close(p[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    *wall = now() - start;
+    return status;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+    fputs("usage: differ [-a ARG]... [-x FACTOR] [-t SECONDS] MDCAT REF FILE...\n",
+          stderr);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char  *args[2][MAX_ARGS + 3];
+    int    nargs   = 1;
+    double factor  = 4;
+    int    timeout = 10;
+    int    i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc && nargs < MAX_ARGS) {
+            args[0][nargs] = args[1][nargs] = argv[++i];
+            nargs++;
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            factor = atof(argv[++i]);
+            if (factor <= 1) usage();
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+            if (timeout < 1) usage();
+        } else {
+            usage();
+        }
+    }
+    if (argc - i < 3) usage();
+    args[0][0] = argv[i++];
+    args[1][0] = argv[i++];
+
+    int     n   = argc - i;
+    Result *res = calloc((size_t)n, sizeof *res);
+    double *per = calloc((size_t)n, sizeof *per);
+    Buf     out[2] = { { 0 } };
+    int     nper = 0, rc = 0;
+    if (!res || !per) { fputs("differ: out of memory\n", stderr); return 1; }
+
+    for (int k = 0; k < n; k++, i++) {
+        Result     *r = &res[k];
+        struct stat st;
+        int         status[2];
+
+        r->path = argv[i];
+        if (stat(r->path, &st) < 0) { perror(r->path); return 1; }
+        r->size = (long long)st.st_size;
+
+        for (int b = 0; b < 2; b++) {
+            args[b][nargs]     = (char *)r->path;
+            args[b][nargs + 1] = NULL;
+            status[b] = run_once(args[b], (unsigned)timeout, &out[b], &r->wall[b]);
+            if (status[b] == -1) { perror(args[b][0]); return 1; }
+            if (WIFSIGNALED(status[b]) && WTERMSIG(status[b]) == SIGALRM) r->timeout = 1;
+        }
+        r->diff = status[0] != status[1] || out[0].len != out[1].len
+                  || memcmp(out[0].buf, out[1].buf, out[0].len) != 0;
+        if (r->diff || r->timeout) rc = 1;
+        if (r->size >= MIN_SIZE && !r->timeout) per[nper++] = r->wall[0] / (double)r->size;
+    }
+
+    qsort(per, (size_t)nper, sizeof *per, cmp_double);
+    double median = nper ? per[nper / 2] : 0;
+
+    printf("%-24s %8s %9s %9s %7s %8s\n",
+           "input", "MB", "new ms", "ref ms", "ratio", "ns/byte");
+    for (int k = 0; k < n; k++) {
+        Result     *r    = &res[k];
+        const char *name = strrchr(r->path, '/') ? strrchr(r->path, '/') + 1 : r->path;
+        double      nsb  = r->size ? r->wall[0] / (double)r->size * 1e9 : 0;
+        int         slow = r->wall[0] >= MIN_WALL
+                           && (r->wall[0] > factor * r->wall[1]
+                               || (r->size >= MIN_SIZE
+                                   && r->wall[0] / (double)r->size > factor * median));
+
+        printf("%-24s %8.2f %9.1f %9.1f %7.2f %8.2f%s%s%s\n",
+               name, (double)r->size / (1024.0 * 1024.0),
+               r->wall[0] * 1e3, r->wall[1] * 1e3,
+               r->wall[1] > 0 ? r->wall[0] / r->wall[1] : 0, nsb,
+               r->diff ? "  DIFF" : "", r->timeout ? "  TIMEOUT" : "",
+               slow ? "  SLOW" : "");
+    }
+    return rc;
+}
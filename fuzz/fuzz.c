@@ -0,0 +1,164 @@
+/*
+ * fuzz.c — fuzz target for the renderer, built by `make fuzz`
+ *
+ * Every input is rendered twice through libmdcat: once handed over in a
+ * single mdcat_feed() call, which parses the buffer in place, and once in
+ * small pieces, which go through the line-assembly buffer.  The two
+ * outputs must be identical; anything else, like the sanitizers' reports,
+ * aborts.  The first byte of the input picks the options (colour, reflow
+ * width, table streaming, output format) so those paths are fuzzed as well.
+ * JSON output must also be valid UTF-8, whatever bytes the input holds.
+ * A third context has its first write fail, then renders the input again
+ * as its next document, which must come out the same as in the others.
+ *
+ * With -DFUZZ_MAIN the file has its own main() that runs the target once
+ * per file argument (stdin if none), for AFL and for replaying crashes
+ * with any compiler:
+ *
+ *     make fuzz/replay CC=afl-gcc
+ *     afl-fuzz -i seeds -o findings -x fuzz/markdown.dict -- fuzz/replay @@
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mdcat.h"
+
+typedef struct {
+    char  *buf;
+    size_t len, cap;
+    int    fail;   /* fail the next write */
+} Sink;
+
+static int sink_write(void *user, const char *buf, size_t len)
+{
+    Sink *s = user;
+    if (s->fail) {
+        s->fail = 0;
+        return -1;
+    }
+    if (s->len + len > s->cap) {
+        size_t cap = s->cap ? s->cap : 4096;
+        while (cap < s->len + len) cap *= 2;
+        if (!(s->buf = realloc(s->buf, cap))) abort();
+        s->cap = cap;
+    }
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    return 0;
+}
+
+/* Render data[0, size) fed in pieces of `step` bytes into s */
+static void render(const mdcat_options *opt, const char *data, size_t size,
+                   size_t step, Sink *s)
+{
+    mdcat_ctx *ctx = mdcat_new(opt, sink_write, s);
+
+    s->len = 0;
+    for (size_t i = 0; i < size; i += step)
+        mdcat_feed(ctx, data + i, size - i < step ? size - i : step);
+    mdcat_finish(ctx);
+    mdcat_free(ctx);
+}
+
+/* Render data[0, size) into s with a context whose previous document
+ * stopped at a write error */
+static void render_after_error(const mdcat_options *opt, const char *data,
+                               size_t size, Sink *s)
+{
+    mdcat_ctx *ctx = mdcat_new(opt, sink_write, s);
+
+    s->fail = 1;
+    mdcat_feed(ctx, data, size);
+    mdcat_finish(ctx);
+    s->fail = 0;
+    s->len  = 0;
+    mdcat_feed(ctx, data, size);
+    mdcat_finish(ctx);
+    mdcat_free(ctx);
+}
+
+static int same(const Sink *a, const Sink *b)
+{
+    return a->len == b->len && (!a->len || memcmp(a->buf, b->buf, a->len) == 0);
+}
+
+/* Whether s[0, n) is well-formed UTF-8 */
+static int utf8_ok(const unsigned char *s, size_t n)
+{
+    for (size_t i = 0; i < n; ) {
+        unsigned c = s[i++], lo = 0x80, hi = 0xBF, need;
+        if (c < 0x80) continue;
+        if (c < 0xC2 || c > 0xF4) return 0;
+        need = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+        if      (c == 0xE0) lo = 0xA0;
+        else if (c == 0xED) hi = 0x9F;
+        else if (c == 0xF0) lo = 0x90;
+        else if (c == 0xF4) hi = 0x8F;
+        for (; need; need--, i++, lo = 0x80, hi = 0xBF)
+            if (i >= n || s[i] < lo || s[i] > hi) return 0;
+    }
+    return 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static Sink   whole, split, again;
+    mdcat_options opt = { 1, -1, 0, MDCAT_TERMINAL };
+
+    if (size > 0) {
+        opt.color        = data[0] & 1;
+        opt.width        = data[0] & 2 ? 8 + (data[0] >> 3) : 0;
+        opt.table_stream = data[0] & 4 ? (data[0] >> 6) : -1;
+        opt.format       = (data[0] >> 5) % 3;
+        data++, size--;
+    }
+    render(&opt, (const char *)data, size, size ? size : 1, &whole);
+    render(&opt, (const char *)data, size, 1 + size % 61, &split);
+    render_after_error(&opt, (const char *)data, size, &again);
+    if (!same(&whole, &split)) {
+        fputs("fuzz: output depends on how the input is fed\n", stderr);
+        abort();
+    }
+    if (!same(&whole, &again)) {
+        fputs("fuzz: a write error carries into the next document\n", stderr);
+        abort();
+    }
+    if (opt.format == MDCAT_JSON && !utf8_ok((const unsigned char *)whole.buf, whole.len)) {
+        fputs("fuzz: JSON output is not valid UTF-8\n", stderr);
+        abort();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_MAIN
+static int run_file(const char *path)
+{
+    FILE  *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    char  *buf = NULL;
+    size_t len = 0, cap = 0, n;
+
+    if (!f) { perror(path); return 1; }
+    do {
+        if (len == cap && !(buf = realloc(buf, cap = cap ? cap * 2 : 65536))) abort();
+        n = fread(buf + len, 1, cap - len, f);
+        len += n;
+    } while (n > 0);
+    if (f != stdin) fclose(f);
+    LLVMFuzzerTestOneInput((const uint8_t *)buf, len);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+    if (argc < 2) return run_file("-");
+    for (int i = 1; i < argc; i++) rc |= run_file(argv[i]);
+    return rc;
+}
+#endif
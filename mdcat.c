@@ -14,588 +14,5797 @@
  *   - Block quotes (> text)
  *   - Tables (GFM pipe syntax, with alignment)
  *
- * Usage: mdcat [file]   (reads stdin if no file given)
+ * Usage: mdcat [-j N] [--width=N] [--table-stream=N] [file ...]  (stdin if none)
+ *        mdcat -f [--width=N] [--table-stream=N] file         (follow a file)
+ *        mdcat --cache-dir=DIR [--cache-size=MB] ...   (reuse rendered output)
+ *        mdcat --theme=FILE ...                        (restyle the colours)
+ *        mdcat --stats ...                             (counters on stderr)
+ *        mdcat --pager [file]                          (page through a document)
+ *        mdcat --section=TEXT | --lines=A-B [--index] file  (render a part)
+ *        mdcat --serve[=SOCKET]                        (render framed requests)
+ *        mdcat --format=html|json [--also-html=FILE] ...  (other outputs)
  *
  * ANSI codes are suppressed automatically when stdout is not a TTY.
+ *
+ * Built with -DMDCAT_LIB this file is libmdcat instead: the renderer
+ * behind the streaming API in mdcat.h, without main() and the CLI.
  */
 
+#define _POSIX_C_SOURCE 200809L   /* posix_madvise() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <unistd.h>   /* isatty() */
+#include <dirent.h>   /* opendir() */
+#include <errno.h>
+#include <stddef.h>   /* offsetof() */
+#include <stdint.h>
+#include <fcntl.h>    /* open() */
+#include <poll.h>     /* poll(), for -f */
+#include <pthread.h>
+#include <unistd.h>   /* isatty(), read(), write() */
+#include <sys/ioctl.h> /* TIOCGWINSZ */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/socket.h> /* socket(), for --serve */
+#include <sys/uio.h>  /* writev() */
+#include <sys/un.h>   /* sockaddr_un */
+#include <signal.h>   /* sigaction() */
+#include <termios.h>  /* tcsetattr() */
+#include <time.h>     /* nanosleep(), time() */
+
+#include "mdcat.h"
+#include "width_table.h"   /* generated: make width-table */
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#define HAVE_INOTIFY 1
+#define HAVE_SENDFILE 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+   || defined(__NetBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define HAVE_KQUEUE 1
+#endif
 
 /* ── ANSI escape sequences ───────────────────────────────────────────────── */
+/*
+ * Renderers do not print escapes: ansi(o, A_*) switches on a theme role,
+ * which changes the style the Out wants, and the first visible byte after
+ * a change emits one SGR sequence taking the terminal from its current
+ * style to that one (see sgr_sync).  A style is packed into 32 bits:
+ * attributes, then the foreground and background as their SGR number
+ * (30..37, 40..47) or 256 + a 256-colour index, 0 being the default.
+ *
+ * A theme maps every role to a style.  Plain output uses a theme of zeros
+ * and so never emits a sequence; roles add their attributes to the active
+ * style and replace only the colours they set.
+ */
 
-#define A_RESET     "\033[0m"
-#define A_BOLD      "\033[1m"
-#define A_DIM       "\033[2m"
-#define A_ITALIC    "\033[3m"
-#define A_UNDER     "\033[4m"
+enum {
+    A_RESET,        /* back to plain */
+    A_BOLD,         /* **strong** */
+    A_ITALIC,       /* *emphasis* */
+    A_CODE,         /* `inline code` */
+    A_FENCE_OPEN,   /* the line opening a fence */
+    A_FENCE_LANG,   /* its [language] label */
+    A_FENCE,        /* fenced code */
+    A_H1, A_H1_RULE, A_H2, A_H3,
+    A_QUOTE_BAR, A_QUOTE,
+    A_MARKER,       /* list bullets and numbers */
+    A_BORDER,       /* table borders */
+    A_TH,           /* table header cells */
+    A_HR,
+    /* highlighted fenced code, over A_FENCE */
+    A_HL_KEYWORD, A_HL_STRING, A_HL_NUMBER, A_HL_COMMENT,
+    A_HL_META,      /* preprocessor, decorators, variables, diff headers */
+    A_HL_KEY,       /* JSON and YAML keys */
+    A_HL_ADD, A_HL_DEL,   /* diff lines */
+    A_NROLES
+};
 
-/* Foreground colours */
-#define A_FG_RED    "\033[31m"
-#define A_FG_GREEN  "\033[32m"
-#define A_FG_YELLOW "\033[33m"
-#define A_FG_BLUE   "\033[34m"
-#define A_FG_MAGENTA "\033[35m"
-#define A_FG_CYAN   "\033[36m"
-#define A_FG_WHITE  "\033[37m"
+#define S_BOLD    0x1u
+#define S_DIM     0x2u
+#define S_ITALIC  0x4u
+#define S_UNDER   0x8u
+#define S_ATTRS   0xFu
+#define S_FG(c)   ((uint32_t)(c) << 4)
+#define S_BG(c)   ((uint32_t)(c) << 13)
+#define S_FGMASK  S_FG(0x1FF)
+#define S_BGMASK  S_BG(0x1FF)
 
-/* Background for inline code */
-#define A_BG_CODE   "\033[48;5;236m"  /* dark grey cell */
-#define A_FG_CODE   "\033[38;5;215m"  /* soft orange */
+static const uint32_t theme_plain[A_NROLES];
 
-static int g_color = 1;   /* set to 0 when stdout is not a TTY */
+/* The colour theme; the command-line tool may load another at startup. */
+static uint32_t theme_color[A_NROLES] = {
+    [A_BOLD]       = S_BOLD,
+    [A_ITALIC]     = S_ITALIC,
+    [A_CODE]       = S_FG(256 + 215) | S_BG(256 + 236),   /* orange on grey */
+    [A_FENCE_OPEN] = S_DIM,
+    [A_FENCE_LANG] = S_FG(32),
+    [A_FENCE]      = S_FG(256 + 215),
+    [A_H1]         = S_BOLD | S_UNDER | S_FG(36),
+    [A_H1_RULE]    = S_DIM | S_FG(36),
+    [A_H2]         = S_BOLD | S_FG(33),
+    [A_H3]         = S_BOLD | S_FG(35),
+    [A_QUOTE_BAR]  = S_DIM | S_FG(32),
+    [A_QUOTE]      = S_ITALIC | S_FG(32),
+    [A_MARKER]     = S_BOLD | S_FG(33),
+    [A_BORDER]     = S_DIM,
+    [A_TH]         = S_BOLD | S_FG(36),
+    [A_HR]         = S_DIM,
+    [A_HL_KEYWORD] = S_BOLD | S_FG(256 + 75),
+    [A_HL_STRING]  = S_FG(256 + 114),
+    [A_HL_NUMBER]  = S_FG(256 + 141),
+    [A_HL_COMMENT] = S_ITALIC | S_FG(256 + 245),
+    [A_HL_META]    = S_FG(256 + 176),
+    [A_HL_KEY]     = S_FG(256 + 81),
+    [A_HL_ADD]     = S_FG(32),
+    [A_HL_DEL]     = S_FG(31),
+};
 
-/* Emit an ANSI sequence only when color is enabled */
-static void ansi(const char *seq)
+static void *xrealloc(void *p, size_t n)
 {
-    if (g_color) fputs(seq, stdout);
+    p = realloc(p, n);
+    if (!p && n) {
+        fputs("mdcat: out of memory\n", stderr);
+        exit(1);
+    }
+    return p;
 }
 
-/* ── Inline span renderer ────────────────────────────────────────────────── */
+/* ── Statistics (--stats) ────────────────────────────────────────────────── */
 /*
- * State machine that walks a line and handles:
- *   `code`   bold+italic (***), bold (**  or __), italic (* or _)
- *
- * Limitations (by design - single-pass, no backtracking):
- *   - Markers must be balanced on the same line.
- *   - Nesting bold inside italic is not supported.
+ * Counters and per-stage times for --stats.  They are updated only through
+ * the STAT_* macros, so a build with -DMDCAT_NO_STATS (and the library)
+ * has no trace of them; otherwise they cost one test of Out.stats while
+ * --stats is off.  Time spent draining output is taken out of the stage
+ * that filled the buffer.
  */
 
-#define SPAN_NONE   0
-#define SPAN_BOLD   1
-#define SPAN_ITALIC 2
-#define SPAN_BI     3   /* bold + italic */
+#if !defined(MDCAT_LIB) && !defined(MDCAT_NO_STATS)
+#define MDCAT_STATS 1
+#else
+#define MDCAT_STATS 0
+#endif
 
-static void render_inline(const char *s, int len)
+enum { ST_PARSE, ST_TABLE, ST_TEXT, ST_WRITE, ST_NSTAGES };
+enum { SL_BLANK, SL_PARA, SL_HEADING, SL_QUOTE, SL_LIST, SL_HR, SL_FENCE,
+       SL_TABLE, SL_NKINDS };
+
+typedef struct {
+    uint64_t bytes_in, bytes_out, sgr_bytes;
+    uint64_t lines[SL_NKINDS];   /* rendered blocks by kind */
+    uint64_t rows, cells;        /* table rows including headers */
+    uint64_t ns[ST_NSTAGES];
+    uint64_t lap_write;          /* ns[ST_WRITE] when the last block began */
+} Stats;
+
+static uint64_t clock_ns(void)
 {
-    int i = 0;
-    int state = SPAN_NONE;   /* current active span */
-    int in_code = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    while (i < len) {
-        unsigned char c = (unsigned char)s[i];
+#if MDCAT_STATS
 
-        /* ── backtick: inline code ───────────────────────────────────────── */
-        if (c == '`' && !in_code) {
-            /* find closing backtick */
-            int j = i + 1;
-            while (j < len && s[j] != '`') j++;
-            if (j < len) {
-                ansi(A_BG_CODE);
-                ansi(A_FG_CODE);
-                putchar(' ');
-                for (int k = i + 1; k < j; k++) putchar(s[k]);
-                putchar(' ');
-                ansi(A_RESET);
-                /* restore active span */
-                if (state == SPAN_BOLD)        { ansi(A_BOLD); }
-                else if (state == SPAN_ITALIC)  { ansi(A_ITALIC); }
-                else if (state == SPAN_BI)      { ansi(A_BOLD); ansi(A_ITALIC); }
-                i = j + 1;
-                continue;
-            }
-            /* no closing backtick — fall through and print literal */
-        }
+#define STAT_ADD(o, field, n) \
+    do { if ((o)->stats) (o)->stats->field += (n); } while (0)
+#define STAT_VAR(t)      uint64_t t = 0
+#define STAT_CLOCK(o, t) do { if ((o)->stats) t = clock_ns(); } while (0)
+/* Charge the time since `t` to `stage` and restart `t` */
+#define STAT_LAP(o, stage, t) \
+    do { if ((o)->stats) { uint64_t n_ = clock_ns(); \
+                           (o)->stats->ns[stage] += n_ - t; t = n_; } } while (0)
+#else
+#define STAT_ADD(o, field, n)  ((void)0)
+#define STAT_VAR(t)            ((void)0)
+#define STAT_CLOCK(o, t)       ((void)0)
+#define STAT_LAP(o, stage, t)  ((void)0)
+#endif
 
-        /* ── asterisk / underscore: bold / italic ───────────────────────── */
-        if ((c == '*' || c == '_') && !in_code) {
-            /* count run length (max 3) */
-            int run = 0;
-            char marker = (char)c;
-            while (i + run < len && s[i + run] == marker && run < 3) run++;
+/* ── Output sink ─────────────────────────────────────────────────────────── */
+/*
+ * All rendered bytes go through an Out buffer instead of stdio: renderers
+ * append bytes and runs, and the buffer is drained with one write() per
+ * OUT_CAP bytes.  A chunk too big to buffer is sent together with the
+ * pending bytes in a single writev().  An Out may drain into a write
+ * callback instead (the library), and an Out with neither collects
+ * everything in memory (used by the -j workers).
+ *
+ * The command-line tool adapts that to its stdout (out_adapt).  To a
+ * terminal, which may be a slow link, output goes at the end of a block
+ * once TTY_FLUSH bytes are pending or have waited TTY_FLUSH_MS, so the
+ * screen fills early and in whole blocks, without a write per line; with
+ * streamed input, what is pending waits as long for more before it goes.
+ * Pipes and files get fewer, larger writes of PIPE_CAP bytes.
+ */
 
-            if (run == 3) {
-                if (state == SPAN_BI) { ansi(A_RESET); state = SPAN_NONE; }
-                else                  { ansi(A_BOLD); ansi(A_ITALIC); state = SPAN_BI; }
-                i += 3;
-                continue;
-            }
-            if (run == 2) {
-                if (state == SPAN_BOLD) { ansi(A_RESET); state = SPAN_NONE; }
-                else                    { ansi(A_BOLD); state = SPAN_BOLD; }
-                i += 2;
-                continue;
-            }
-            if (run == 1) {
-                if (state == SPAN_ITALIC) { ansi(A_RESET); state = SPAN_NONE; }
-                else                      { ansi(A_ITALIC); state = SPAN_ITALIC; }
-                i += 1;
-                continue;
-            }
-        }
+#define OUT_CAP      (64 * 1024)
+#define PIPE_CAP     (256 * 1024)
+#define TTY_FLUSH    (32 * 1024)
+#define TTY_FLUSH_MS 25
+#define SGR_MEMO_BITS 7   /* highlighted code switches between many styles */
+#define SGR_MEMO (1 << SGR_MEMO_BITS)
 
-        /* ── ordinary character ──────────────────────────────────────────── */
-        putchar(c);
-        i++;
-    }
+typedef struct {
+    uint64_t      key;       /* cur << 32 | want */
+    unsigned char len;
+    char          seq[31];   /* the longest SGR sequence is 30 bytes */
+} SgrMemo;
 
-    /* close any unclosed span */
-    if (state != SPAN_NONE) ansi(A_RESET);
+#define NEST_MAX 16                   /* containers around a line, at most */
+#define MK_DEPTH (2 * NEST_MAX + 4)   /* JSON arrays nest: items, blocks, rows,
+                                         cells, inline runs */
+
+/* A container open in markup output: a quote, or a list item in its list */
+typedef struct {
+    uint32_t      id;     /* Nest.id */
+    unsigned char kind;   /* NS_* */
+} MkLevel;
+
+/* Elements open in markup output (--format=html|json) */
+typedef struct {
+    MkLevel  lvl[NEST_MAX];   /* the open containers, outermost first */
+    int      nlvl;
+    int      base;       /* JSON: array depth of the blocks in them */
+    int      first;      /* no block yet in the innermost list item; */
+    int      bare;       /* HTML: the open paragraph is its text, no <p>, */
+    int      owe;        /*       and is closed: a '\n' must come first */
+    uint32_t blanks;     /* blank lines held back in indented code */
+    int      open;       /* MK_* leaf element the output is in */
+    int      style;      /* SPAN_* bits of the open inline elements */
+    int      inner;      /* HTML: the one opened last while both are */
+    int      run;        /* JSON: a text run is open, */
+    int      runstyle;   /*       with these SPAN_* bits */
+    uint32_t n[MK_DEPTH];   /* JSON: elements so far in the open arrays */
+} Markup;
+
+typedef struct Out {
+    char   *buf;
+    size_t  len, cap;
+    int     fd;    /* -1: memory sink, the buffer grows instead of draining */
+    mdcat_write_fn write;   /* drains instead of fd when set */
+    void   *user;
+    const uint32_t *theme;        /* style of each A_* role */
+    uint32_t sgr_cur, sgr_want;   /* terminal style: emitted, and wanted */
+    SgrMemo  sgr_memo[SGR_MEMO];   /* recent transitions, by (cur, want) */
+    int      line_sgr;     /* end the style at every '\n' (the pager) */
+    int     width; /* reflow text to this many columns; 0: never */
+    int     para;  /* reflow: BK_* of the paragraph on the open line, or -1 */
+    int     col, indent;   /* reflow: column on that line, and its indent */
+    unsigned char pfx[NEST_MAX];   /* container prefix of the open block: */
+    int     npfx;          /*   0 a quote bar, else that many spaces */
+    int     quote;         /* and it is in a quote */
+    int     hl, hl_state;  /* open fence: HL_* language or -1, lexer state */
+    int     err;   /* set once a write fails; further output is dropped */
+    size_t  flush_at;   /* at a block end, flush once this much is pending */
+    int     flush_ms;   /*   or has waited this long; 0: when full */
+    uint64_t since;     /* clock_ns() when it began to wait, or 0 */
+    int     format;   /* MDCAT_TERMINAL, MDCAT_HTML or MDCAT_JSON */
+    Markup  mk;       /* markup formats: what is open */
+    struct Out *also; /* renders the same IR too (--also-html), or NULL */
+    struct TableCol *tcol;    /* the open table's columns, as laid out */
+    uint32_t ntcol, tcolcap;
+#if MDCAT_STATS
+    Stats  *stats; /* --stats: counters to update, or NULL */
+#endif
+} Out;
+
+/* Forget the document being rendered: open elements, lines and style */
+static void out_reset(Out *o)
+{
+    o->sgr_cur = o->sgr_want = 0;
+    o->para  = -1;
+    o->col   = o->indent = 0;
+    o->npfx  = o->quote = 0;
+    o->hl    = -1;
+    o->hl_state = 0;
+    memset(&o->mk, 0, sizeof o->mk);
+    o->ntcol = 0;
 }
 
-/* ── Line-level renderer ─────────────────────────────────────────────────── */
+static void out_init(Out *o, int fd, const mdcat_options *opt)
+{
+    o->buf   = xrealloc(NULL, OUT_CAP);
+    o->len   = 0;
+    o->cap   = OUT_CAP;
+    o->fd    = fd;
+    o->write = NULL;
+    o->user  = NULL;
+    o->format = opt->format;
+    o->theme = opt->color && opt->format == MDCAT_TERMINAL ? theme_color : theme_plain;
+    o->line_sgr = 0;
+    memset(o->sgr_memo, 0, sizeof o->sgr_memo);
+    o->width = opt->width;
+    o->err   = 0;
+    o->flush_at = 0;
+    o->flush_ms = 0;
+    o->since    = 0;
+    o->also  = NULL;
+    o->tcol  = NULL;
+    o->tcolcap = 0;
+    out_reset(o);
+#if MDCAT_STATS
+    o->stats = NULL;
+#endif
+}
 
-#define MAX_LINE 4096
+/* True when the buffer drains, false for a memory sink */
+static int out_drains(const Out *o)
+{
+    return o->fd >= 0 || o->write;
+}
 
-static void render_inline(const char *s, int len);   /* forward decl */
+static void out_free(Out *o)
+{
+    free(o->buf);
+    free(o->tcol);
+    o->buf  = NULL;
+    o->tcol = NULL;
+}
 
-/* ── Table support ───────────────────────────────────────────────────────── */
+/* write() all of iov[0..n), restarting after EINTR and short writes */
+static void write_iov(Out *o, struct iovec *iov, int n)
+{
+    if (o->write) {
+        for (; n > 0 && !o->err; iov++, n--)
+            o->err = o->write(o->user, iov->iov_base, iov->iov_len);
+        return;
+    }
+    while (n > 0 && !o->err) {
+        ssize_t w = writev(o->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            o->err = errno;
+            return;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++; n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+}
 
-#define MAX_COLS  16
-#define MAX_CELL  128
+static void out_writev(Out *o, struct iovec *iov, int n)
+{
+    STAT_VAR(t);
+    STAT_CLOCK(o, t);
+#if MDCAT_STATS
+    for (int i = 0; i < n; i++) STAT_ADD(o, bytes_out, iov[i].iov_len);
+#endif
+    write_iov(o, iov, n);
+    STAT_LAP(o, ST_WRITE, t);
+}
 
-typedef enum { ALIGN_LEFT, ALIGN_CENTER, ALIGN_RIGHT } Align;
+static void out_flush(Out *o)
+{
+    if (o->len == 0 || !out_drains(o)) return;
+    struct iovec iov = { o->buf, o->len };
+    out_writev(o, &iov, 1);
+    o->len   = 0;
+    o->since = 0;
+}
 
-/*
- * Split a pipe-delimited row into cells.
- * Leading/trailing pipes and whitespace around cells are stripped.
- * Returns number of cells found (<= MAX_COLS).
- */
-static int split_row(const char *line, char cells[MAX_COLS][MAX_CELL])
+/* Milliseconds the pending output may still wait: 0 when it is due, -1
+ * when there is none or it waits for the buffer to fill. */
+static int out_hold(Out *o)
 {
-    int ncols = 0;
-    const char *p = line;
+    if (o->len == 0 || !o->flush_ms) return -1;
+    if (o->len >= o->flush_at) return 0;
 
-    /* skip optional leading pipe */
-    if (*p == '|') p++;
+    uint64_t now = clock_ns();
+    if (!o->since) o->since = now;
+    uint64_t age = (now - o->since) / 1000000u;
+    return age >= (uint64_t)o->flush_ms ? 0 : o->flush_ms - (int)age;
+}
 
-    while (*p && ncols < MAX_COLS) {
-        /* find next unescaped '|' or end-of-string */
-        const char *start = p;
-        while (*p && *p != '|') p++;
+/* End of a rendered block: where a flush is due, if it is. */
+static void out_block_end(Out *o)
+{
+    if (o->flush_ms && o->len && out_hold(o) == 0) out_flush(o);
+}
 
-        /* copy and trim whitespace */
-        int clen = (int)(p - start);
-        while (clen > 0 && start[0] == ' ')  { start++; clen--; }
-        while (clen > 0 && start[clen-1] == ' ') clen--;
+/* Make room for `n` (<= OUT_CAP) more bytes: drain, or grow a memory sink */
+static void out_reserve(Out *o, size_t n)
+{
+    if (out_drains(o)) { out_flush(o); return; }
+    while (o->cap - o->len < n) o->cap *= 2;
+    o->buf = xrealloc(o->buf, o->cap);
+}
 
-        if (clen >= MAX_CELL) clen = MAX_CELL - 1;
-        memcpy(cells[ncols], start, (size_t)clen);
-        cells[ncols][clen] = '\0';
-        ncols++;
+/* Append raw bytes, escapes included */
+static void out_bytes(Out *o, const char *s, size_t n)
+{
+    if (n > o->cap - o->len) {
+        if (out_drains(o) && n >= OUT_CAP) {
+            /* large chunk: bypass the buffer, one syscall for both parts */
+            struct iovec iov[2] = { { o->buf, o->len }, { (void *)s, n } };
+            out_writev(o, iov, 2);
+            o->len = 0;
+            return;
+        }
+        out_reserve(o, n);
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
 
-        if (*p == '|') p++;   /* consume the pipe */
+/* Append ";c" for an SGR colour c (see above); `ext` is "38" or "48" */
+static char *sgr_colour(char *p, uint32_t c, const char *ext)
+{
+    *p++ = ';';
+    if (c >= 256) {
+        *p++ = ext[0]; *p++ = ext[1]; *p++ = ';'; *p++ = '5'; *p++ = ';';
+        c -= 256;
+        if (c >= 100) *p++ = (char)('0' + c / 100);
+        if (c >= 10)  *p++ = (char)('0' + c / 10 % 10);
+    } else {
+        *p++ = (char)('0' + c / 10);
     }
-    return ncols;
+    *p++ = (char)('0' + c % 10);
+    return p;
+}
+
+/* Append the SGR parameters of `s` (attributes `attrs` only) to p. */
+static char *sgr_params(char *p, uint32_t s, uint32_t attrs)
+{
+    uint32_t fg = (s & S_FGMASK) >> 4, bg = (s & S_BGMASK) >> 13;
+
+    for (int i = 0; i < 4; i++)
+        if (attrs & (1u << i)) { *p++ = ';'; *p++ = (char)('1' + i); }
+    if (fg) p = sgr_colour(p, fg, "38");
+    if (bg) p = sgr_colour(p, bg, "48");
+    return p;
 }
 
 /*
- * Inspect a separator row like | --- | :---: | ---: |
- * Returns 1 if it looks like a valid separator, 0 otherwise.
- * Fills align[] for each column.
+ * Emit one SGR sequence from the current style to the wanted one: either
+ * the changes (22/23/24/39/49 switching things off) or a reset followed by
+ * the whole style, whichever is shorter.  Documents switch between a few
+ * styles, so the sequences are memoised per Out.
  */
-static int parse_sep(const char *line, Align align[], int ncols)
+static void sgr_sync(Out *o)
 {
-    char cells[MAX_COLS][MAX_CELL];
-    int n = split_row(line, cells);
-    if (n != ncols) return 0;
+    uint32_t cur = o->sgr_cur, want = o->sgr_want;
+    uint64_t key = (uint64_t)cur << 32 | want;
+    char     full[48], diff[64], *p;
 
-    for (int i = 0; i < n; i++) {
-        const char *c = cells[i];
-        int len = (int)strlen(c);
-        if (len == 0) return 0;
+    o->sgr_cur = want;
+    if (want == 0) {
+        out_bytes(o, "\033[0m", 4);
+        STAT_ADD(o, sgr_bytes, 4);
+        return;
+    }
+    SgrMemo *m = &o->sgr_memo[(key * 0x9E3779B97F4A7C15ULL) >> (64 - SGR_MEMO_BITS)];
+    if (m->key == key) {
+        out_bytes(o, m->seq, m->len);
+        STAT_ADD(o, sgr_bytes, m->len);
+        return;
+    }
 
-        /* must be only '-', ':', or space */
-        for (int k = 0; k < len; k++)
-            if (c[k] != '-' && c[k] != ':') return 0;
+    p = sgr_params(full, want, want & S_ATTRS);
+    size_t nfull = (size_t)(p - full);
 
-        int left  = (c[0] == ':');
-        int right = (c[len-1] == ':');
+    uint32_t off = cur & ~want & S_ATTRS, on = want & ~cur & S_ATTRS;
+    p = diff;
+    if (off & (S_BOLD | S_DIM)) {   /* 22 clears both */
+        memcpy(p, ";22", 3);
+        p += 3;
+        on |= want & (S_BOLD | S_DIM);
+    }
+    if (off & S_ITALIC) { memcpy(p, ";23", 3); p += 3; }
+    if (off & S_UNDER)  { memcpy(p, ";24", 3); p += 3; }
+    if ((cur & S_FGMASK) && !(want & S_FGMASK)) { memcpy(p, ";39", 3); p += 3; }
+    if ((cur & S_BGMASK) && !(want & S_BGMASK)) { memcpy(p, ";49", 3); p += 3; }
+    uint32_t chg = 0;
+    if ((want & S_FGMASK) != (cur & S_FGMASK)) chg |= want & S_FGMASK;
+    if ((want & S_BGMASK) != (cur & S_BGMASK)) chg |= want & S_BGMASK;
+    p = sgr_params(p, chg, on);
+    size_t ndiff = (size_t)(p - diff);
 
-        if (left && right) align[i] = ALIGN_CENTER;
-        else if (right)    align[i] = ALIGN_RIGHT;
-        else               align[i] = ALIGN_LEFT;
+    char *seq = m->seq;
+    seq[0] = '\033';
+    seq[1] = '[';
+    if (ndiff - 1 <= nfull + 1) {
+        p = (char *)memcpy(seq + 2, diff + 1, ndiff - 1) + ndiff - 1;
+    } else {
+        seq[2] = '0';
+        p = (char *)memcpy(seq + 3, full, nfull) + nfull;
     }
-    return 1;
+    *p++ = 'm';
+    m->key = key;
+    m->len = (unsigned char)(p - seq);
+    out_bytes(o, seq, m->len);
+    STAT_ADD(o, sgr_bytes, m->len);
+}
+
+static void out_write(Out *o, const char *s, size_t n)
+{
+    if (o->sgr_want != o->sgr_cur) sgr_sync(o);
+    out_bytes(o, s, n);
+}
+
+static inline void out_putc(Out *o, char c)
+{
+    if (c == '\n' && o->line_sgr) {
+        /* each line sets its own style, so it can be printed alone */
+        if (o->sgr_cur) out_bytes(o, "\033[0m", 4);
+        o->sgr_cur = 0;
+    } else if (o->sgr_want != o->sgr_cur) {
+        sgr_sync(o);
+    }
+    if (o->len == o->cap) out_reserve(o, 1);
+    o->buf[o->len++] = c;
+}
+
+static void out_puts(Out *o, const char *s)
+{
+    out_write(o, s, strlen(s));
+}
+
+/* Append `count` copies of the `ulen`-byte sequence `unit` */
+static void out_repeat(Out *o, const char *unit, size_t ulen, size_t count)
+{
+    if (count > 0 && o->sgr_want != o->sgr_cur) sgr_sync(o);
+    while (count > 0) {
+        if (o->cap - o->len < ulen) out_reserve(o, ulen);
+        size_t fit = (o->cap - o->len) / ulen;
+        if (fit > count) fit = count;
+        char *d = o->buf + o->len;
+        if (ulen == 1) {
+            memset(d, unit[0], fit);
+        } else {
+            for (size_t i = 0; i < fit; i++, d += ulen) memcpy(d, unit, ulen);
+        }
+        o->len += fit * ulen;
+        count -= fit;
+    }
+}
+
+/* Switch on theme role `role` (A_RESET: back to plain) */
+static inline void ansi(Out *o, int role)
+{
+    uint32_t s = o->theme[role], w = role == A_RESET ? 0 : o->sgr_want;
+    if (s & S_FGMASK) w &= ~S_FGMASK;
+    if (s & S_BGMASK) w &= ~S_BGMASK;
+    o->sgr_want = w | s;
+}
+
+/* End of a document: leave the terminal in the plain style. */
+static void sgr_end(Out *o)
+{
+    o->sgr_want = 0;
+    if (o->sgr_cur) sgr_sync(o);
 }
 
+/* ── Input layer ─────────────────────────────────────────────────────────── */
 /*
- * Count the number of visible terminal columns that render_inline() would
- * occupy for the given string.
- *
- * Two sources of invisible/miscounted bytes:
- *   1. Markdown markers (* _ ` and combinations) - not printed at all.
- *   2. Multi-byte UTF-8 sequences - count as one character, not N bytes.
- *
- * We do not attempt full Unicode width (CJK wide chars etc.) - that would
- * require wcwidth() which drags in locale machinery.  ASCII + Latin + the
- * Unicode box/symbol characters found in typical Markdown docs are all
- * single-column, so counting codepoints is sufficient here.
+ * The whole input is made available as one read-only buffer so that the
+ * block renderers can work on (ptr, len) line slices without copying.
+ * Regular files are mmap()ed, except small ones, which one read() fetches
+ * for less than the mapping and its page faults cost; pipes, ttys and
+ * anything mmap() refuses are slurped with large read() calls into a
+ * growing heap buffer.
  */
-static int visible_len(const char *s, int len)
+
+#define READ_BLOCK (64 * 1024)
+#define SMALL_FILE (64 * 1024)   /* read() rather than mmap() up to this */
+
+#ifndef MDCAT_LIB
+
+typedef struct {
+    const char *data;
+    size_t      len;
+    int         mapped;   /* 1: release with munmap(), 0: with free() */
+} Input;
+
+/* Returns 0 on success, -1 with errno set on failure. */
+static int input_open(Input *in, int fd)
 {
-    int vis = 0;
-    int i   = 0;
+    struct stat st;
 
-    while (i < len) {
-        unsigned char c = (unsigned char)s[i];
+    in->data = NULL; in->len = 0; in->mapped = 0;
 
-        /* backtick span: skip markers, count content codepoints + 2 spaces */
-        if (c == '`') {
-            int j = i + 1;
-            while (j < len && s[j] != '`') j++;
-            if (j < len) {
-                vis += 2;   /* padding spaces around inline code */
-                /* count codepoints between the backticks */
-                for (int k = i + 1; k < j; ) {
-                    unsigned char b = (unsigned char)s[k];
-                    if      (b < 0x80) k += 1;
-                    else if (b < 0xE0) k += 2;
-                    else if (b < 0xF0) k += 3;
-                    else               k += 4;
-                    vis++;
-                }
-                i = j + 1;
-                continue;
-            }
-            /* no closing backtick — literal char */
-            vis++; i++;
-            continue;
-        }
+    int reg = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
 
-        /* bold/italic markers: skip the run of * or _ (ASCII, 1 byte each) */
-        if (c == '*' || c == '_') {
-            int run = 0;
-            char mk = (char)c;
-            while (i + run < len && s[i + run] == mk && run < 3) run++;
-            i += run;
-            continue;
+    if (reg && st.st_size <= SMALL_FILE) {
+        /* the size is known, so no second read() to see end of file */
+        size_t size = (size_t)st.st_size, len = 0;
+        char  *buf  = malloc(size);
+        if (!buf) return -1;
+        while (len < size) {
+            ssize_t n = read(fd, buf + len, size - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { int e = errno; free(buf); errno = e; return -1; }
+            if (n == 0) break;
+            len += (size_t)n;
+        }
+        in->data = buf; in->len = len;
+        return 0;
+    }
+    if (reg) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->data = p; in->len = (size_t)st.st_size; in->mapped = 1;
+            return 0;
         }
+    }
 
-        /* multi-byte UTF-8: advance past the whole codepoint, count once */
-        if      (c < 0x80) i += 1;
-        else if (c < 0xE0) i += 2;
-        else if (c < 0xF0) i += 3;
-        else               i += 4;
-        vis++;
+    size_t cap = READ_BLOCK, len = 0;
+    char  *buf = malloc(cap);
+    if (!buf) return -1;
+    for (;;) {
+        if (len == cap) {
+            char *nb = realloc(buf, cap * 2);
+            if (!nb) { free(buf); errno = ENOMEM; return -1; }
+            buf = nb; cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int e = errno; free(buf); errno = e;
+            return -1;
+        }
+        if (n == 0) break;
+        len += (size_t)n;
     }
-    return vis;
+    in->data = buf; in->len = len;
+    return 0;
 }
 
-/* Print exactly `w` visible characters of `text`, padding with spaces. */
-static void print_cell(const char *text, int w, Align align)
+static void input_close(Input *in)
 {
-    int vlen = visible_len(text, (int)strlen(text));
-    int pad  = w - vlen;
-    if (pad < 0) pad = 0;
+    if (in->mapped) munmap((void *)in->data, in->len);
+    else            free((void *)in->data);
+    in->data = NULL; in->len = 0;
+}
 
-    int lpad = 0, rpad = pad;
-    if (align == ALIGN_CENTER) { lpad = pad / 2; rpad = pad - lpad; }
-    else if (align == ALIGN_RIGHT) { lpad = pad; rpad = 0; }
+/*
+ * Fetch the next line of [*pos, end) as a slice (without its '\n') and
+ * advance *pos past it.  Returns 0 at end of input.
+ */
+static int next_line(const char **pos, const char *end,
+                     const char **line, size_t *len)
+{
+    const char *p = *pos;
+    if (p >= end) return 0;
 
-    for (int i = 0; i < lpad; i++) putchar(' ');
-    render_inline(text, (int)strlen(text));
-    for (int i = 0; i < rpad; i++) putchar(' ');
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    *line = p;
+    if (nl) { *len = (size_t)(nl - p);  *pos = nl + 1; }
+    else    { *len = (size_t)(end - p); *pos = end; }
+    return 1;
 }
 
-/* Horizontal rule for table borders using box-drawing chars */
-static void table_hline(const int widths[], int ncols)
+#endif /* !MDCAT_LIB */
+
+/* ── Document IR ─────────────────────────────────────────────────────────── */
+/*
+ * Parsing and rendering are separate passes over a flat intermediate form:
+ * the parser turns each source line into a Block and the inline markup of
+ * its text into a run of Spans; the renderer only walks those arrays.
+ * Neither holds text.  Blocks are offsets into the source buffer and spans
+ * are offsets into their block's line, so both stay small and contiguous.
+ * The arrays are emptied after every rendered batch and reused.
+ *
+ * Block quotes and list items are containers, a tree of Nest nodes: a
+ * block is the part of its line after the container markers (Block.off
+ * points past them) and names the innermost container it is in.
+ */
+
+typedef enum { ALIGN_LEFT, ALIGN_CENTER, ALIGN_RIGHT } Align;
+
+enum {
+    BK_BLANK,        /* empty line */
+    BK_PARA,         /* ordinary paragraph line */
+    BK_HEADING,      /* level = number of '#' */
+    BK_HR,
+    BK_FENCE_OPEN,   /* info string is line[3 .. len) */
+    BK_FENCE_LINE,
+    BK_FENCE_CLOSE,  /* level = 1: closed by end of input */
+    BK_TABLE,        /* header row; spans are its cells */
+    BK_TABLE_ROW,    /* body row; spans are its cells */
+    BK_TABLE_END,    /* table blocks: text = column count, col = first
+                        column in Doc.cols */
+    BK_CODE          /* indented code; text = offset past the indent */
+};
+
+enum { NS_QUOTE, NS_BULLET, NS_ORDERED };
+
+enum {
+    SP_TEXT,         /* literal text */
+    SP_CODE,         /* inline code, backticks excluded */
+    SP_STYLE,        /* emphasis markers; style is the SPAN_* bits from here */
+    SP_CELL          /* table cell; the spans up to the next SP_CELL are its
+                        content and width is that of the whole cell */
+};
+
+#define SPAN_NONE   0
+#define SPAN_BOLD   1
+#define SPAN_ITALIC 2
+#define SPAN_BI     (SPAN_BOLD | SPAN_ITALIC)
+
+typedef struct {
+    size_t        off;      /* first byte of the line in Doc.src */
+    uint32_t      len;      /* line length, '\n' excluded */
+    uint32_t      text;     /* offset of the text after the block marker */
+    uint32_t      span;     /* first span in Doc.spans */
+    uint32_t      nspans;
+    uint32_t      col;      /* table blocks only */
+    uint32_t      nest;     /* innermost container: Doc.nest index + 1, or 0 */
+    unsigned char kind;     /* BK_* */
+    unsigned char level;
+    unsigned char fresh;    /* innermost containers whose marker starts the line */
+    unsigned char cont;     /* BK_PARA: continues the previous block's paragraph */
+} Block;
+
+typedef struct {
+    uint32_t      off;      /* from the start of the block's line */
+    uint32_t      len;
+    uint32_t      width;    /* visible terminal columns */
+    unsigned char kind;     /* SP_* */
+    unsigned char style;    /* SP_STYLE only */
+} Span;
+
+typedef struct {
+    int   width;
+    Align align;
+} Column;
+
+typedef struct {
+    uint32_t      parent;   /* Doc.nest index + 1, or 0 at the top */
+    uint32_t      id;       /* numbers the containers of a document from 1 */
+    size_t        mark;     /* NS_ORDERED: the number, as an offset in Doc.src
+                               (only while the item's first line is in the IR), */
+    unsigned char marklen;  /*   and its length */
+    unsigned char kind;     /* NS_* */
+    unsigned char depth;    /* containers up to and including this one */
+} Nest;
+
+/* IR offsets are 32-bit: a line longer than this is handled as several */
+#define IR_LINE_MAX UINT32_MAX
+
+/* Scratch space of the inline parser, kept with the IR to be reused */
+typedef struct {
+    uint32_t      span;         /* first of the spans reserved for it */
+    uint32_t      len, left;    /* IN_DELIM: length of the run, unused part */
+    int32_t       prev, next;   /* IN_DELIM: neighbours still on the list */
+    uint32_t      os, oe;       /* IN_DELIM: strong / em pairs opened */
+    uint32_t      cs, ce;       /*           and closed here */
+    unsigned char kind;         /* IN_* */
+    unsigned char c;            /* IN_DELIM: '*' or '_' */
+    unsigned char flags;        /* IN_DELIM: DL_OPEN | DL_CLOSE */
+} Inl;
+
+typedef struct {
+    uint32_t off, len;
+    uint32_t match;             /* index + 1 of the closing run, or 0 */
+} Tick;
+
+typedef struct {
+    Inl      *item;
+    size_t    nitem, itemcap;
+    int32_t   delims, tail;     /* ends of the delimiter list, or -1 */
+    int32_t   bottom[2][3][2];  /* openers are after these, see delim_close() */
+    Tick     *tick;             /* backtick runs of one line */
+    size_t    ntick, tickcap;
+    uint32_t *last;             /* by run length: latest Tick index + 1 */
+    size_t    lastcap;
+} Inline;
+
+typedef struct {
+    const char *src;        /* buffer that Block.off is relative to */
+    Block      *blocks;
+    size_t      nblocks, blockcap;
+    Span       *spans;
+    size_t      nspans, spancap;
+    Column     *cols;       /* columns of the tables in the IR */
+    size_t      ncols, colcap;
+    Nest       *nest;       /* containers of the blocks in the IR */
+    size_t      nnest, nestcap;
+    uint32_t    cur;        /* new blocks are in this one (Block.nest) */
+    unsigned char fresh;    /* and the next opens this many (Block.fresh) */
+    Inline      in;
+} Doc;
+
+static Block *doc_block(Doc *d, int kind, const char *line, size_t len,
+                        size_t text)
 {
-    ansi(A_DIM);
-    /* left corner or T-junction */
-    fputs("\xe2\x94\x9c", stdout);   /* ├ */
-    for (int c = 0; c < ncols; c++) {
-        for (int i = 0; i < widths[c] + 2; i++)
-            fputs("\xe2\x94\x80", stdout);   /* ─ */
-        if (c < ncols - 1) fputs("\xe2\x94\xbc", stdout);  /* ┼ */
-        else               fputs("\xe2\x94\xa4", stdout);  /* ┤ */
+    if (d->nblocks == d->blockcap) {
+        d->blockcap = d->blockcap ? d->blockcap * 2 : 1024;
+        d->blocks   = xrealloc(d->blocks, d->blockcap * sizeof *d->blocks);
     }
-    ansi(A_RESET);
-    putchar('\n');
+    Block *b  = &d->blocks[d->nblocks++];
+    b->off    = line ? (size_t)(line - d->src) : 0;
+    b->len    = (uint32_t)len;
+    b->text   = (uint32_t)text;
+    b->span   = (uint32_t)d->nspans;
+    b->nspans = 0;
+    b->col    = 0;
+    b->nest   = d->cur;
+    b->kind   = (unsigned char)kind;
+    b->level  = 0;
+    b->fresh  = d->fresh;
+    b->cont   = 0;
+    d->fresh  = 0;
+    return b;
 }
 
-static void table_topline(const int widths[], int ncols)
+static Span *doc_span(Doc *d, int kind, size_t off, size_t len, int width)
 {
-    ansi(A_DIM);
-    fputs("\xe2\x94\x8c", stdout);   /* ┌ */
-    for (int c = 0; c < ncols; c++) {
-        for (int i = 0; i < widths[c] + 2; i++)
-            fputs("\xe2\x94\x80", stdout);
-        if (c < ncols - 1) fputs("\xe2\x94\xac", stdout);  /* ┬ */
-        else               fputs("\xe2\x94\x90", stdout);  /* ┐ */
+    if (d->nspans == d->spancap) {
+        d->spancap = d->spancap ? d->spancap * 2 : 4096;
+        d->spans   = xrealloc(d->spans, d->spancap * sizeof *d->spans);
     }
-    ansi(A_RESET);
-    putchar('\n');
+    Span *s  = &d->spans[d->nspans++];
+    s->off   = (uint32_t)off;
+    s->len   = (uint32_t)len;
+    s->width = (uint32_t)width;
+    s->kind  = (unsigned char)kind;
+    s->style = SPAN_NONE;
+    return s;
+}
+
+/* Close the most recently added block: it owns all spans added since. */
+static void doc_end_block(Doc *d)
+{
+    Block *b  = &d->blocks[d->nblocks - 1];
+    b->nspans = (uint32_t)(d->nspans - b->span);
 }
 
-static void table_botline(const int widths[], int ncols)
+/* Reserve `n` columns for a new table; returns the index of the first. */
+static size_t doc_cols(Doc *d, size_t n)
 {
-    ansi(A_DIM);
-    fputs("\xe2\x94\x94", stdout);   /* └ */
-    for (int c = 0; c < ncols; c++) {
-        for (int i = 0; i < widths[c] + 2; i++)
-            fputs("\xe2\x94\x80", stdout);
-        if (c < ncols - 1) fputs("\xe2\x94\xb4", stdout);  /* ┴ */
-        else               fputs("\xe2\x94\x98", stdout);  /* ┘ */
+    if (d->ncols + n > d->colcap) {
+        while (d->ncols + n > d->colcap) d->colcap = d->colcap ? d->colcap * 2 : 64;
+        d->cols = xrealloc(d->cols, d->colcap * sizeof *d->cols);
     }
-    ansi(A_RESET);
-    putchar('\n');
+    d->ncols += n;
+    return d->ncols - n;
 }
 
-static void render_row(char cells[MAX_COLS][MAX_CELL],
-                       int ncols, const int widths[], const Align align[],
-                       int is_header)
+/* Add a container inside d->cur; returns its Doc.nest index. */
+static uint32_t doc_nest(Doc *d, int kind, uint32_t id, size_t mark, size_t marklen)
 {
-    ansi(A_DIM); fputs("\xe2\x94\x82", stdout); ansi(A_RESET);  /* │ */
-    for (int c = 0; c < ncols; c++) {
-        putchar(' ');
-        if (is_header) { ansi(A_BOLD); ansi(A_FG_CYAN); }
-        print_cell(cells[c], widths[c], align[c]);
-        if (is_header) ansi(A_RESET);
-        putchar(' ');
-        ansi(A_DIM); fputs("\xe2\x94\x82", stdout); ansi(A_RESET);  /* │ */
+    if (d->nnest == d->nestcap) {
+        d->nestcap = d->nestcap ? d->nestcap * 2 : 64;
+        d->nest    = xrealloc(d->nest, d->nestcap * sizeof *d->nest);
     }
-    putchar('\n');
+    Nest *n    = &d->nest[d->nnest];
+    n->parent  = d->cur;
+    n->id      = id;
+    n->mark    = mark;
+    n->marklen = (unsigned char)marklen;
+    n->kind    = (unsigned char)kind;
+    n->depth   = (unsigned char)(d->cur ? d->nest[d->cur - 1].depth + 1 : 1);
+    return (uint32_t)d->nnest++;
+}
+
+static void doc_free(Doc *d)
+{
+    free(d->blocks);
+    free(d->spans);
+    free(d->cols);
+    free(d->nest);
+    free(d->in.item);
+    free(d->in.tick);
+    free(d->in.last);
 }
 
+/* ── Inline tokenizer ────────────────────────────────────────────────────── */
+/*
+ * Recognises `code`, bold (** or __) and italic (* or _), nested in any
+ * way, and measures the visible width of every span as it goes, so the
+ * layout code never has to rescan the text.
+ *
+ * Widths are terminal columns.  Runs of plain ASCII are measured by the
+ * scanners below; anything else goes through text_width(), which looks
+ * every codepoint up in the generated width_table.h (East Asian Wide and
+ * emoji 2, combining marks 0) instead of calling wcwidth() and dragging
+ * in the locale machinery.
+ */
+
 /*
- * Render a complete table.
- * header_cells / sep_line are already read; body rows are read from fp.
- * Stops when a non-pipe line (or EOF) is encountered; that line is written
- * into `leftover` (MAX_LINE bytes) for the caller to process.
+ * Text scanning.  The tokenizer spends its time in two loops: finding the
+ * next inline marker (` * _) and counting the codepoints of the plain text
+ * before it.  Both run 16 or 32 bytes at a time where the CPU allows it:
+ * SSE2 is part of x86-64, AVX2 is picked at run time by scan_init(), and
+ * NEON is part of AArch64.  A codepoint is any byte that is not a UTF-8
+ * continuation byte (10xxxxxx), so a block costs one compare and a
+ * popcount.
+ *
+ *   scan_text(s, n, &w)  index of the first marker in s[0..n) (n if none);
+ *                        adds the codepoints before it to w
+ *   utf8_width(s, n)     codepoints in s[0..n)
  */
-static void render_table(FILE *fp,
-                         char header_cells[MAX_COLS][MAX_CELL],
-                         int ncols,
-                         const Align align[],
-                         char leftover[MAX_LINE])
+
+static size_t scan_text_scalar(const char *s, size_t n, int *w)
+{
+    int    cp = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        unsigned char b = (unsigned char)s[i];
+        if (b == '`' || b == '*' || b == '_') break;
+        cp += (b & 0xC0) != 0x80;
+    }
+    *w += cp;
+    return i;
+}
+
+static int utf8_width_scalar(const char *s, size_t n)
 {
-    /* Collect all body rows first so we can compute column widths. */
-#define MAX_ROWS 256
-    char body[MAX_ROWS][MAX_COLS][MAX_CELL];
-    int  nrows = 0;
+    int w = 0;
+    for (size_t i = 0; i < n; i++)
+        w += ((unsigned char)s[i] & 0xC0) != 0x80;
+    return w;
+}
 
-    leftover[0] = '\0';
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_X86 1
 
-    while (nrows < MAX_ROWS && fgets(leftover, MAX_LINE, fp)) {
-        int ll = (int)strlen(leftover);
-        if (ll > 0 && leftover[ll-1] == '\n') leftover[--ll] = '\0';
+static size_t scan_text_sse2(const char *s, size_t n, int *w)
+{
+    const __m128i bt = _mm_set1_epi8('`'), st = _mm_set1_epi8('*');
+    const __m128i us = _mm_set1_epi8('_'), hi = _mm_set1_epi8((char)0xC0);
+    const __m128i ct = _mm_set1_epi8((char)0x80);
+    size_t i  = 0;
+    int    cp = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i  v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i  m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, bt),
+                                               _mm_cmpeq_epi8(v, st)),
+                                  _mm_cmpeq_epi8(v, us));
+        unsigned mk = (unsigned)_mm_movemask_epi8(m);
+        unsigned cc = (unsigned)_mm_movemask_epi8(
+                          _mm_cmpeq_epi8(_mm_and_si128(v, hi), ct));
+        if (mk) {
+            unsigned k = (unsigned)__builtin_ctz(mk);
+            cp += (int)k - __builtin_popcount(cc & ((1u << k) - 1));
+            *w += cp;
+            return i + k;
+        }
+        cp += 16 - __builtin_popcount(cc);
+    }
+    *w += cp;
+    return i + scan_text_scalar(s + i, n - i, w);
+}
 
-        if (leftover[0] != '|') break;   /* end of table */
+static int utf8_width_sse2(const char *s, size_t n)
+{
+    const __m128i hi = _mm_set1_epi8((char)0xC0), ct = _mm_set1_epi8((char)0x80);
+    size_t i = 0;
+    int    w = 0;
 
-        split_row(leftover, body[nrows]);
-        nrows++;
-        leftover[0] = '\0';
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        w += 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(
+                      _mm_cmpeq_epi8(_mm_and_si128(v, hi), ct)));
     }
+    return w + utf8_width_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_text_avx2(const char *s, size_t n, int *w)
+{
+    const __m256i bt = _mm256_set1_epi8('`'), st = _mm256_set1_epi8('*');
+    const __m256i us = _mm256_set1_epi8('_'), hi = _mm256_set1_epi8((char)0xC0);
+    const __m256i ct = _mm256_set1_epi8((char)0x80);
+    size_t i  = 0;
+    int    cp = 0;
 
-    /* Compute column widths based on visible (rendered) character count */
-    int widths[MAX_COLS];
-    for (int c = 0; c < ncols; c++) {
-        widths[c] = visible_len(header_cells[c], (int)strlen(header_cells[c]));
-        if (widths[c] < 3) widths[c] = 3;
-        for (int r = 0; r < nrows; r++) {
-            int cw = visible_len(body[r][c], (int)strlen(body[r][c]));
-            if (cw > widths[c]) widths[c] = cw;
+    for (; i + 32 <= n; i += 32) {
+        __m256i  v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i  m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, bt),
+                                                     _mm256_cmpeq_epi8(v, st)),
+                                     _mm256_cmpeq_epi8(v, us));
+        unsigned mk = (unsigned)_mm256_movemask_epi8(m);
+        unsigned cc = (unsigned)_mm256_movemask_epi8(
+                          _mm256_cmpeq_epi8(_mm256_and_si256(v, hi), ct));
+        if (mk) {
+            unsigned k = (unsigned)__builtin_ctz(mk);
+            cp += (int)k - __builtin_popcount(cc & ((1u << k) - 1));
+            *w += cp;
+            return i + k;
         }
+        cp += 32 - __builtin_popcount(cc);
     }
+    *w += cp;
+    return i + scan_text_sse2(s + i, n - i, w);
+}
 
-    /* Render */
-    table_topline(widths, ncols);
-    render_row(header_cells, ncols, widths, align, 1);
-    table_hline(widths, ncols);
-    for (int r = 0; r < nrows; r++)
-        render_row(body[r], ncols, widths, align, 0);
-    table_botline(widths, ncols);
+__attribute__((target("avx2")))
+static int utf8_width_avx2(const char *s, size_t n)
+{
+    const __m256i hi = _mm256_set1_epi8((char)0xC0), ct = _mm256_set1_epi8((char)0x80);
+    size_t i = 0;
+    int    w = 0;
 
-#undef MAX_ROWS
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        w += 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(
+                      _mm256_cmpeq_epi8(_mm256_and_si256(v, hi), ct)));
+    }
+    return w + utf8_width_sse2(s + i, n - i);
 }
 
-static void render_hr(void)
+static size_t (*scan_text)(const char *, size_t, int *) = scan_text_sse2;
+static int    (*utf8_width)(const char *, size_t)       = utf8_width_sse2;
+
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+
+static size_t scan_text_neon(const char *s, size_t n, int *w)
 {
-    ansi(A_DIM);
-    for (int i = 0; i < 60; i++) putchar('\xe2'), putchar('\x94'), putchar('\x80'); /* UTF-8 ─ */
-    ansi(A_RESET);
-    putchar('\n');
+    const uint8x16_t bt = vdupq_n_u8('`'), st = vdupq_n_u8('*');
+    const uint8x16_t us = vdupq_n_u8('_'), hi = vdupq_n_u8(0xC0);
+    const uint8x16_t ct = vdupq_n_u8(0x80), one = vdupq_n_u8(1);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)s + i);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, bt), vceqq_u8(v, st)),
+                                vceqq_u8(v, us));
+        if (vmaxvq_u8(m)) break;   /* marker in this block: finish scalar */
+        uint8x16_t cc = vandq_u8(vceqq_u8(vandq_u8(v, hi), ct), one);
+        *w += 16 - (int)vaddvq_u8(cc);
+    }
+    return i + scan_text_scalar(s + i, n - i, w);
 }
 
-static void render_file(FILE *fp)
+static int utf8_width_neon(const char *s, size_t n)
 {
-    char line[MAX_LINE];
-    char peek[MAX_LINE];   /* one-line lookahead */
-    int  have_peek = 0;
-    int  in_fence  = 0;
+    const uint8x16_t hi = vdupq_n_u8(0xC0), ct = vdupq_n_u8(0x80);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+    int    w = 0;
 
-    /* Helper: get next line into `line`, using peek buffer if available */
-#define NEXTLINE() ( have_peek \
-        ? (memcpy(line, peek, MAX_LINE), have_peek = 0, 1) \
-        : (fgets(line, MAX_LINE, fp) != NULL) )
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v  = vld1q_u8((const uint8_t *)s + i);
+        uint8x16_t cc = vandq_u8(vceqq_u8(vandq_u8(v, hi), ct), one);
+        w += 16 - (int)vaddvq_u8(cc);
+    }
+    return w + utf8_width_scalar(s + i, n - i);
+}
 
-    while (NEXTLINE()) {
-        int len = (int)strlen(line);
-        if (len > 0 && line[len-1] == '\n') line[--len] = '\0';
+static size_t (*scan_text)(const char *, size_t, int *) = scan_text_neon;
+static int    (*utf8_width)(const char *, size_t)       = utf8_width_neon;
 
-        /* ── fenced code block ──────────────────────────────────────────── */
-        if (strncmp(line, "```", 3) == 0) {
-            in_fence = !in_fence;
-            if (in_fence) {
-                ansi(A_DIM);
-                if (line[3] != '\0') {
-                    ansi(A_FG_GREEN);
-                    printf("[%s]\n", line + 3);
-                    ansi(A_RESET);
-                } else {
-                    putchar('\n');
-                }
-            } else {
-                ansi(A_RESET);
-                putchar('\n');
-            }
-            continue;
-        }
+#else
 
-        if (in_fence) {
-            ansi(A_FG_CODE);
-            printf("  %s\n", line);
-            ansi(A_RESET);
-            continue;
-        }
+static size_t (*scan_text)(const char *, size_t, int *) = scan_text_scalar;
+static int    (*utf8_width)(const char *, size_t)       = utf8_width_scalar;
 
-        /* ── blank line ─────────────────────────────────────────────────── */
-        if (len == 0) { putchar('\n'); continue; }
+#endif
 
-        /* ── horizontal rule: ---, ***, === (3+ chars, all same) ────────── */
-        {
-            int hr = 1;
-            char fc = line[0];
-            if (fc == '-' || fc == '*' || fc == '=') {
-                for (int i = 0; i < len; i++)
-                    if (line[i] != fc) { hr = 0; break; }
-                if (hr && len >= 3) { render_hr(); continue; }
-            }
-        }
+static void scan_pick(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_text  = scan_text_avx2;
+        utf8_width = utf8_width_avx2;
+    }
+#endif
+}
 
-        /* ── table: pipe-prefixed line followed by separator ────────────── */
-        if (line[0] == '|') {
-            /* peek at next line to check for separator row */
-            if (!have_peek && fgets(peek, MAX_LINE, fp)) {
-                int pl = (int)strlen(peek);
-                if (pl > 0 && peek[pl-1] == '\n') peek[--pl] = '\0';
-                have_peek = 1;
-            }
+/* Pick the widest scanner the CPU supports; call before rendering. */
+static void scan_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, scan_pick);
+}
 
-            if (have_peek && peek[0] == '|') {
-                char header[MAX_COLS][MAX_CELL];
-                int  ncols = split_row(line, header);
-                Align align[MAX_COLS];
-
-                if (parse_sep(peek, align, ncols)) {
-                    /* consume the separator line from lookahead */
-                    have_peek = 0;
-                    /* render_table reads body rows and fills leftover */
-                    char leftover[MAX_LINE];
-                    render_table(fp, header, ncols, align, leftover);
-                    /* if a non-table line was read, re-queue it */
-                    if (leftover[0] != '\0') {
-                        memcpy(peek, leftover, MAX_LINE);
-                        have_peek = 1;
-                    }
-                    continue;
-                }
-                /* not a table — fall through, peek stays queued */
-            }
-        }
+/* Columns of codepoint c, from the two-stage table */
+static inline int cp_width(uint32_t c)
+{
+    return (width_blocks[width_index[c >> 8]][(c & 255) >> 2] >> (2 * (c & 3))) & 3;
+}
 
-        /* ── headings ───────────────────────────────────────────────────── */
-        if (line[0] == '#') {
-            int level = 0;
-            while (level < len && line[level] == '#') level++;
-            if (level <= 6 && line[level] == ' ') {
-                const char *text = line + level + 1;
-                putchar('\n');
-                if (level == 1) {
-                    ansi(A_BOLD); ansi(A_FG_CYAN); ansi(A_UNDER);
-                    render_inline(text, (int)strlen(text));
-                    ansi(A_RESET); putchar('\n');
-                    ansi(A_FG_CYAN); ansi(A_DIM);
-                    int tlen = (int)strlen(text);
-                    for (int i = 0; i < tlen + 2; i++)
-                        putchar('\xe2'), putchar('\x95'), putchar('\x90');
-                    ansi(A_RESET); putchar('\n');
-                } else if (level == 2) {
-                    ansi(A_BOLD); ansi(A_FG_YELLOW);
-                    render_inline(text, (int)strlen(text));
-                    ansi(A_RESET); putchar('\n');
-                } else {
-                    ansi(A_BOLD); ansi(A_FG_MAGENTA);
-                    render_inline(text, (int)strlen(text));
-                    ansi(A_RESET); putchar('\n');
-                }
-                continue;
-            }
-        }
+/*
+ * Decode the character at s[0..n): returns its length in bytes and stores
+ * its columns in *w.  A stray continuation byte is zero-width and a
+ * malformed sequence one column, as when widths counted codepoints.
+ */
+static inline size_t utf8_char(const char *p, size_t n, int *w)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    uint32_t c = s[0];
+    size_t   len = 1, need;
+
+    if (c < 0x80) { *w = 1; return 1; }
+    if (c < 0xC0) { *w = 0; return 1; }
+    need = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+    c &= 0x3Fu >> need;
+    while (len <= need && len < n && (s[len] & 0xC0) == 0x80)
+        c = c << 6 | (s[len++] & 0x3F);
+    *w = (len == need + 1 && c < 0x110000) ? cp_width(c) : 1;
+    return len;
+}
+
+/*
+ * Columns of s[0..n), decoding every non-ASCII character.  Well-formed
+ * two- and three-byte sequences, which cover the BMP, are decoded inline;
+ * everything else goes through utf8_char().
+ */
+static int utf8_cols(const char *p, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    int w = 0;
+
+    for (size_t i = 0; i < n; ) {
+        unsigned c = s[i];
+        if (c < 0x80) { w++; i++; continue; }
 
-        /* ── block quote ────────────────────────────────────────────────── */
-        if (line[0] == '>' && (line[1] == ' ' || line[1] == '\0')) {
-            const char *text = (line[1] == ' ') ? line + 2 : "";
-            ansi(A_FG_GREEN); ansi(A_DIM);
-            fputs("\xe2\x94\x82 ", stdout);
-            ansi(A_RESET); ansi(A_ITALIC); ansi(A_FG_GREEN);
-            render_inline(text, (int)strlen(text));
-            ansi(A_RESET); putchar('\n');
+        unsigned c1 = i + 1 < n ? s[i + 1] : 0;
+        if (c >= 0xC2 && c < 0xE0 && (c1 & 0xC0) == 0x80) {
+            w += cp_width((c & 0x1F) << 6 | (c1 & 0x3F));
+            i += 2;
             continue;
         }
-
-        /* ── bullet list: -, *, + ───────────────────────────────────────── */
-        if ((line[0] == '-' || line[0] == '*' || line[0] == '+') && line[1] == ' ') {
-            const char *text = line + 2;
-            fputs("  ", stdout);
-            ansi(A_FG_YELLOW); ansi(A_BOLD);
-            fputs("\xe2\x80\xa2 ", stdout);
-            ansi(A_RESET);
-            render_inline(text, (int)strlen(text));
-            putchar('\n');
+        unsigned c2 = i + 2 < n ? s[i + 2] : 0;
+        if (c >= 0xE0 && c < 0xF0 && (c1 & 0xC0) == 0x80 && (c2 & 0xC0) == 0x80) {
+            w += cp_width((c & 0x0F) << 12 | (c1 & 0x3F) << 6 | (c2 & 0x3F));
+            i += 3;
             continue;
         }
+        int cw;
+        i += utf8_char(p + i, n - i, &cw);
+        w += cw;
+    }
+    return w;
+}
 
-        /* ── numbered list: digit(s) followed by ". " ───────────────────── */
-        {
-            int di = 0;
-            while (di < len && isdigit((unsigned char)line[di])) di++;
-            if (di > 0 && di < len - 1 && line[di] == '.' && line[di+1] == ' ') {
-                const char *text = line + di + 2;
-                fputs("  ", stdout);
-                ansi(A_FG_YELLOW); ansi(A_BOLD);
-                for (int k = 0; k < di; k++) putchar(line[k]);
-                fputs(". ", stdout);
-                ansi(A_RESET);
-                render_inline(text, (int)strlen(text));
-                putchar('\n');
-                continue;
-            }
-        }
+/* Columns of s[0..n); text without continuation bytes is one per byte */
+static int text_width(const char *s, size_t n)
+{
+    int w = utf8_width(s, n);
+    return (size_t)w == n ? w : utf8_cols(s, n);
+}
 
-        /* ── ordinary paragraph line ────────────────────────────────────── */
-        render_inline(line, len);
-        putchar('\n');
+/*
+ * Length in bytes of the longest prefix of s[0..n) that fits in `*room`
+ * columns.  On return *room holds the columns still available after it.
+ */
+static size_t utf8_prefix(const char *s, size_t n, int *room)
+{
+    size_t i = 0;
+    while (i < n && (unsigned char)s[i] < 0x80 && *room > 0) {
+        i++;
+        (*room)--;
     }
+    while (i < n) {
+        int    w;
+        size_t len = utf8_char(s + i, n - i, &w);
+        if (w > *room) break;
+        *room -= w;
+        i     += len;
+    }
+    return i;
+}
 
-#undef NEXTLINE
+/*
+ * Inline markup is parsed the CommonMark way, in one linear pass over a
+ * paragraph (the lines a reflow would join) or a single line elsewhere.
+ *
+ * inline_scan() goes over each line once.  Backtick runs are paired first:
+ * a run opens code that the next run of the same length closes, found via
+ * a table of the latest run of every length, so stray backticks cost
+ * nothing extra.  Code does not continue onto the next line.  Runs of *
+ * and _ outside code become delimiters that may open and/or close
+ * emphasis, decided by what surrounds them, and each one that can close
+ * is matched against the stack of those before it right away (see
+ * delim_close()).  Pairs nest, so bold inside italic and emphasis over
+ * several lines come out right; a delimiter left over is literal text.
+ *
+ * Spans are written as the line is scanned, with room left for the style
+ * changes a delimiter may turn out to make.  Once the paragraph ends,
+ * inline_patch() fills them in: style spans carry the combined state, and
+ * a line that starts inside emphasis starts with one.
+ */
 
-    if (in_fence) ansi(A_RESET);
-}
+enum { IN_DELIM, IN_LINE };
 
-/* ── Entry point ─────────────────────────────────────────────────────────── */
+#define DL_OPEN  1   /* Inl.flags */
+#define DL_CLOSE 2
 
-int main(int argc, char *argv[])
+/* Lines a paragraph's emphasis may span; longer ones are split */
+#define PARA_LINES 256
+
+static void inline_begin(Doc *d)
 {
-    g_color = isatty(STDOUT_FILENO);
+    int32_t *bot = &d->in.bottom[0][0][0];
+    for (size_t k = 0; k < sizeof d->in.bottom / sizeof *bot; k++) bot[k] = -1;
+    d->in.nitem  = 0;
+    d->in.delims = -1;
+    d->in.tail   = -1;
+}
 
-    if (argc == 1) {
-        render_file(stdin);
-    } else {
-        for (int i = 1; i < argc; i++) {
-            FILE *fp = fopen(argv[i], "r");
-            if (!fp) {
-                fprintf(stderr, "mdcat: cannot open '%s': ", argv[i]);
-                perror(NULL);
-                return 1;
-            }
-            render_file(fp);
-            fclose(fp);
-        }
+static Inl *inline_item(Inline *in, int kind, size_t span)
+{
+    if (in->nitem == in->itemcap) {
+        in->itemcap = in->itemcap ? in->itemcap * 2 : 256;
+        in->item    = xrealloc(in->item, in->itemcap * sizeof *in->item);
     }
-    return 0;
+    Inl *it  = &in->item[in->nitem++];
+    it->kind = (unsigned char)kind;
+    it->span = (uint32_t)span;
+    it->os   = it->oe = it->cs = it->ce = 0;
+    return it;
 }
+
+/* Pair the backtick runs of line[from..to) by length. */
+static void inline_ticks(Inline *in, const char *line, size_t from, size_t to)
+{
+    const char *q = line + from, *end = line + to;
+    uint32_t    max = 0;
+
+    in->ntick = 0;
+    while ((q = memchr(q, '`', (size_t)(end - q)))) {
+        const char *r = q;
+        while (r < end && *r == '`') r++;
+        if (in->ntick == in->tickcap) {
+            in->tickcap = in->tickcap ? in->tickcap * 2 : 64;
+            in->tick    = xrealloc(in->tick, in->tickcap * sizeof *in->tick);
+        }
+        Tick *t  = &in->tick[in->ntick++];
+        t->off   = (uint32_t)(q - line);
+        t->len   = (uint32_t)(r - q);
+        t->match = 0;
+        if (t->len > max) max = t->len;
+        q = r;
+    }
+    if (in->ntick < 2) return;
+
+    if (max >= in->lastcap) {
+        size_t cap = in->lastcap ? in->lastcap : 64;
+        while (cap <= max) cap *= 2;
+        in->last = xrealloc(in->last, cap * sizeof *in->last);
+        memset(in->last + in->lastcap, 0, (cap - in->lastcap) * sizeof *in->last);
+        in->lastcap = cap;
+    }
+    for (size_t t = in->ntick; t-- > 0; ) {
+        Tick *tk  = &in->tick[t];
+        tk->match = in->last[tk->len];
+        in->last[tk->len] = (uint32_t)t + 1;
+    }
+    for (size_t t = 0; t < in->ntick; t++) in->last[in->tick[t].len] = 0;
+}
+
+static int is_space(unsigned char c) { return c == ' ' || c == '\t'; }
+static int is_punct(unsigned char c)   /* ASCII punctuation */
+{
+    return (c >= '!' && c <= '/') || (c >= ':' && c <= '@')
+        || (c >= '[' && c <= '`') || (c >= '{' && c <= '~');
+}
+
+/* Text span for line[off..off+len), joined to the previous one if it abuts */
+static void emit_text(Doc *d, size_t first, size_t off, size_t len, int width)
+{
+    Span *last = d->nspans > first ? &d->spans[d->nspans - 1] : NULL;
+    if (last && last->kind == SP_TEXT && last->off + last->len == off) {
+        last->len   += (uint32_t)len;
+        last->width += (uint32_t)width;
+    } else {
+        doc_span(d, SP_TEXT, off, len, width);
+    }
+}
+
+static void delim_unlink(Inline *in, int32_t k)
+{
+    Inl *it = &in->item[k];
+    if (it->prev >= 0) in->item[it->prev].next = it->next;
+    else               in->delims = it->next;
+    if (it->next >= 0) in->item[it->next].prev = it->prev;
+    else               in->tail   = it->prev;
+}
+
+/*
+ * Pair the newest delimiter, which can close, with the openers before it:
+ * the spec's "process emphasis" done one closer at a time, as it only
+ * ever looks back.  An opener that fails a closer of some kind fails every
+ * later one of that kind too, so in->bottom[] remembers how far down the
+ * search for each kind has to go, which keeps the whole pass linear.
+ */
+static void delim_close(Inline *in, int32_t cl)
+{
+    Inl     *c   = &in->item[cl];
+    int32_t *bot = &in->bottom[c->c == '_'][c->len % 3][(c->flags & DL_OPEN) != 0];
+
+    while (c->left) {
+        int32_t op = c->prev;
+        for (; op > *bot; op = in->item[op].prev) {
+            const Inl *o = &in->item[op];
+            if (o->c != c->c || !(o->flags & DL_OPEN)) continue;
+            if (((o->flags & DL_CLOSE) || (c->flags & DL_OPEN))   /* rule of 3 */
+                && (o->len + c->len) % 3 == 0 && (o->len % 3 || c->len % 3))
+                continue;
+            break;
+        }
+        if (op <= *bot) {
+            *bot = c->prev;
+            if (!(c->flags & DL_OPEN)) delim_unlink(in, cl);
+            return;
+        }
+
+        Inl     *o   = &in->item[op];
+        uint32_t use = o->left >= 2 && c->left >= 2 ? 2 : 1;
+        if (use == 2) { o->os++; c->cs++; }
+        else          { o->oe++; c->ce++; }
+        o->left -= use;
+        c->left -= use;
+        while (o->next != cl) delim_unlink(in, o->next);
+        if (o->left == 0) delim_unlink(in, op);
+    }
+    delim_unlink(in, cl);
+}
+
+/*
+ * Append the spans of line[from..to), the next line of the paragraph
+ * being parsed.  A delimiter run gets a text span for what stays literal
+ * and a style span for each way it can go, closing before it and opening
+ * after it, for inline_patch() to fill in; a line that starts while an
+ * opener is unmatched starts with a style span too.  Returns the visible
+ * width as if all delimiters were literal.
+ */
+static int inline_scan(Doc *d, const char *line, size_t from, size_t to)
+{
+    Inline *in    = &d->in;
+    size_t  first = d->nspans;   /* spans before this may not be merged */
+    size_t  i     = from, t = 0;
+    int     ticks = 0;           /* backtick runs paired */
+    int     width = 0;
+
+    if (in->delims >= 0) {
+        inline_item(in, IN_LINE, d->nspans);
+        doc_span(d, SP_STYLE, from, 0, 0);
+    }
+    while (i < to) {
+        unsigned char c = (unsigned char)line[i];
+
+        /* ── backticks: code up to the next run of as many ─────────────── */
+        if (c == '`') {
+            if (!ticks) { inline_ticks(in, line, i, to); ticks = 1; }
+            Tick *tk = &in->tick[t++];
+            if (tk->match) {
+                Tick  *cl  = &in->tick[tk->match - 1];
+                size_t off = tk->off + tk->len, n = cl->off - off, k = 0;
+                while (k < n && line[off + k] == ' ') k++;
+                if (k < n && line[off] == ' ' && line[off + n - 1] == ' ') off++, n -= 2;
+                int    w   = text_width(line + off, n) + 2;   /* padding */
+                doc_span(d, SP_CODE, off, n, w);
+                width += w;
+                i = cl->off + cl->len;
+                t = tk->match;
+            } else {
+                emit_text(d, first, i, tk->len, (int)tk->len);
+                width += (int)tk->len;
+                i     += tk->len;
+            }
+            continue;
+        }
+
+        /* ── * and _: a delimiter run if it can open or close ───────────── */
+        if (c == '*' || c == '_') {
+            size_t        run = 1;
+            while (i + run < to && line[i + run] == (char)c) run++;
+            unsigned char b = i > from ? (unsigned char)line[i - 1] : ' ';
+            unsigned char a = i + run < to ? (unsigned char)line[i + run] : ' ';
+            int left  = !is_space(a) && (!is_punct(a) || is_space(b) || is_punct(b));
+            int right = !is_space(b) && (!is_punct(b) || is_space(a) || is_punct(a));
+            int flags = c == '*'
+                ? (left ? DL_OPEN : 0) | (right ? DL_CLOSE : 0)
+                : (left && (!right || is_punct(b)) ? DL_OPEN : 0)
+                  | (right && (!left || is_punct(a)) ? DL_CLOSE : 0);
+
+            if (flags) {
+                int32_t k  = (int32_t)in->nitem;
+                size_t  at = d->nspans;
+                if (flags & DL_CLOSE) doc_span(d, SP_STYLE, i, 0, 0);
+                emit_text(d, first, i, run, (int)run);
+                if (!(flags & DL_CLOSE)) at = d->nspans - 1;
+                if (flags & DL_OPEN) doc_span(d, SP_STYLE, i + run, 0, 0);
+
+                Inl *it   = inline_item(in, IN_DELIM, at);
+                it->len   = it->left = (uint32_t)run;
+                it->c     = c;
+                it->flags = (unsigned char)flags;
+                it->prev  = in->tail;
+                it->next  = -1;
+                if (in->tail >= 0) in->item[in->tail].next = k;
+                else               in->delims = k;
+                in->tail = k;
+                if (flags & DL_CLOSE) delim_close(in, k);
+            } else {
+                emit_text(d, first, i, run, (int)run);
+            }
+            width += (int)run;
+            i     += run;
+            continue;
+        }
+
+        /* ── ordinary characters: one span up to the next marker ─────────── */
+        int    w = (c & 0xC0) != 0x80;
+        size_t j = i + 1;
+        j += scan_text(line + j, to - j, &w);
+        if ((size_t)w != j - i) w = utf8_cols(line + i, j - i);
+        emit_text(d, first, i, j - i, w);
+        width += w;
+        i = j;
+    }
+    return width;
+}
+
+static unsigned char depth_style(const uint32_t depth[2])
+{
+    return (unsigned char)((depth[0] ? SPAN_BOLD : 0) | (depth[1] ? SPAN_ITALIC : 0));
+}
+
+/*
+ * Fill in the spans reserved by inline_scan() now that the pairs are
+ * known.  Returns the delimiter characters used up, which take no room.
+ */
+static uint32_t inline_patch(Doc *d)
+{
+    Inline  *in       = &d->in;
+    uint32_t depth[2] = { 0, 0 };   /* strong and em pairs open */
+    uint32_t used     = 0;
+
+    for (size_t k = 0; k < in->nitem; k++) {
+        const Inl *it = &in->item[k];
+        Span      *sp = &d->spans[it->span];
+
+        if (it->kind == IN_LINE) { sp->style = depth_style(depth); continue; }
+
+        /* closing markers first, then what is literal, then opening */
+        uint32_t closing = 2 * it->cs + it->ce;
+        uint32_t opening = 2 * it->os + it->oe;
+
+        if (it->flags & DL_CLOSE) {
+            depth[0] -= it->cs;
+            depth[1] -= it->ce;
+            sp->style = depth_style(depth);
+            sp->len   = closing;
+            sp++;
+        }
+        sp->off   += closing;           /* the text may go on either side */
+        sp->len   -= closing + opening;
+        sp->width -= closing + opening;
+        if (it->flags & DL_OPEN) {
+            depth[0]   += it->os;
+            depth[1]   += it->oe;
+            sp[1].style = depth_style(depth);
+            sp[1].off  -= opening;
+            sp[1].len   = opening;
+        }
+        used += closing + opening;
+    }
+    return used;
+}
+
+/*
+ * Append spans for line[from..to) to the document, as a paragraph of its
+ * own.  Returns the visible width of the text.
+ */
+static int tokenize(Doc *d, const char *line, size_t from, size_t to)
+{
+    inline_begin(d);
+    int width = inline_scan(d, line, from, to);
+    if (d->in.nitem) width -= (int)inline_patch(d);
+    return width;
+}
+
+/* ── Block parser ────────────────────────────────────────────────────────── */
+/*
+ * Lines are pushed into the parser one at a time.  The only lookahead in
+ * the grammar is for tables: a pipe-prefixed line is held back as
+ * `pending` until the next line shows whether it is a separator row.
+ * While a table is being sized its rows stay in the IR, and so do the
+ * lines of a paragraph, whose inline spans are only known at its end;
+ * everywhere else the driver may render and reset the IR between any two
+ * lines.
+ *
+ * Each line is first matched against the open containers, outermost
+ * first: a quote takes a '>', a list item the indent of its text (or a
+ * blank line).  That is O(depth) and never backtracks.  Containers that
+ * do not match are closed, unless the line is the lazy continuation of a
+ * paragraph, and the new markers at the front of what is left open more;
+ * the rest of the line is a leaf block.  Fenced code in a container ends
+ * with it.  Tables are only recognised outside containers.
+ */
+
+enum { TBL_NONE, TBL_SIZING, TBL_FIXED };
+
+typedef struct {
+    uint32_t      node;     /* its Doc.nest index */
+    uint32_t      id;
+    unsigned char kind;     /* NS_* */
+    unsigned char indent;   /* list item: columns its text is indented by */
+    unsigned char marklen;  /* NS_ORDERED: digits of its number */
+} Open;
+
+typedef struct {
+    Doc        *doc;
+    int         in_fence;
+    int         table;      /* TBL_*: widths still growing / final */
+    size_t      tcol;       /* first column of the open table */
+    uint32_t    tncols;
+    long        sized;      /* body rows measured (--table-stream) */
+    long        stream;     /* --table-stream=N; -1: buffer tables */
+    size_t      pending;    /* held-back pipe line (offset in Doc.src) */
+    size_t      pendlen;
+    int         have_pending;
+    size_t      para;       /* first block of the open paragraph */
+    uint32_t    paralines;  /* its lines so far; 0: none is open */
+    int         text;       /* the last block was paragraph text, */
+    uint32_t    textid;     /*   in this container (Nest.id, 0: none) */
+    Open        open[NEST_MAX];   /* the open containers, outermost first */
+    int         depth;
+    int         fence_depth;      /* containers around the open fence */
+    uint32_t    ids;              /* containers opened so far */
+} Parser;
+
+/* True when the IR holds only complete, renderable blocks. */
+static int parser_idle(const Parser *p)
+{
+    return !p->have_pending && p->table != TBL_SIZING && !p->paralines;
+}
+
+/* End the open paragraph: pair its delimiters and settle its lines' spans. */
+static void para_end(Parser *p)
+{
+    Doc *d = p->doc;
+
+    if (!p->paralines) return;
+    if (d->in.nitem) inline_patch(d);
+    p->paralines = 0;
+}
+
+/*
+ * Fetch the next cell of a pipe-delimited row from [*p, end), trimmed of
+ * surrounding spaces.  The caller skips the optional leading pipe.
+ * Returns 0 when the row is exhausted.
+ */
+static int next_cell(const char **p, const char *end,
+                     const char **cell, size_t *clen)
+{
+    const char *q = *p;
+    if (q >= end) return 0;
+
+    /* find next unescaped '|' or end-of-line */
+    const char *start = q;
+    while (q < end && *q != '|') q++;
+
+    /* trim whitespace */
+    size_t n = (size_t)(q - start);
+    while (n > 0 && start[0] == ' ')   { start++; n--; }
+    while (n > 0 && start[n-1] == ' ') n--;
+
+    *cell = start;
+    *clen = n;
+    *p    = (q < end) ? q + 1 : q;   /* consume the pipe */
+    return 1;
+}
+
+/*
+ * Split a pipe-delimited row into SP_CELL spans, one per table column.
+ * Leading/trailing pipes and whitespace around cells are stripped; cells
+ * beyond the column count are ignored and missing ones are left empty.
+ * Column widths grow to fit while the table is still being sized.
+ */
+static void split_row(Parser *p, int kind, const char *line, size_t len)
+{
+    Doc        *d    = p->doc;
+    Column     *cols = d->cols + p->tcol;
+    const char *q    = line;
+    const char *end  = line + len;
+    const char *cell;
+    size_t      clen;
+    uint32_t    c = 0;
+
+    Block *b = doc_block(d, kind, line, len, p->tncols);
+    b->col   = (uint32_t)p->tcol;
+
+    /* skip optional leading pipe */
+    if (q < end && *q == '|') q++;
+
+    for (; c < p->tncols && next_cell(&q, end, &cell, &clen); c++) {
+        size_t off = (size_t)(cell - line);
+        size_t idx = d->nspans;
+        doc_span(d, SP_CELL, off, clen, 0);
+        int w = tokenize(d, line, off, off + clen);
+        d->spans[idx].width = (uint32_t)w;
+        if (p->table == TBL_SIZING && w > cols[c].width) cols[c].width = w;
+    }
+    for (; c < p->tncols; c++) doc_span(d, SP_CELL, 0, 0, 0);
+
+    doc_end_block(d);
+}
+
+/*
+ * Inspect a separator row like | --- | :---: | ---: |
+ * Returns 1 if it looks like a valid separator for `ncols` columns,
+ * 0 otherwise.  Fills cols[] with the alignment and dash count of each.
+ */
+static int parse_sep(Column cols[], int ncols, const char *line, size_t len)
+{
+    const char *p   = line;
+    const char *end = line + len;
+    const char *c;
+    size_t      clen;
+    int         n = 0;
+
+    if (p < end && *p == '|') p++;
+
+    while (next_cell(&p, end, &c, &clen)) {
+        if (n == ncols || clen == 0) return 0;
+
+        /* must be only '-', ':', or space */
+        for (size_t k = 0; k < clen; k++)
+            if (c[k] != '-' && c[k] != ':') return 0;
+
+        int left  = (c[0] == ':');
+        int right = (c[clen-1] == ':');
+
+        if (left && right) cols[n].align = ALIGN_CENTER;
+        else if (right)    cols[n].align = ALIGN_RIGHT;
+        else               cols[n].align = ALIGN_LEFT;
+        cols[n].width = (int)clen;
+        n++;
+    }
+    return n == ncols;
+}
+
+/*
+ * Start a table if `sep` is a separator row matching `header`.
+ *
+ * Normally every body row is collected before anything is rendered so that
+ * column widths fit the widest cell.  With --table-stream=N only the first
+ * N body rows are used for sizing (N = 0: the separator's dash counts);
+ * later rows can be rendered as soon as they are parsed, so memory stays
+ * constant however long the table is.
+ */
+static int table_start(Parser *p, const char *header, size_t hlen,
+                       const char *sep, size_t seplen)
+{
+    Doc        *d   = p->doc;
+    const char *q   = header;
+    const char *end = header + hlen;
+    const char *cell;
+    size_t      clen;
+    int         n = 0;
+
+    if (q < end && *q == '|') q++;
+    while (next_cell(&q, end, &cell, &clen)) n++;
+
+    size_t col = doc_cols(d, (size_t)n);
+    if (!parse_sep(d->cols + col, n, sep, seplen)) {
+        d->ncols = col;
+        return 0;
+    }
+
+    para_end(p);
+    p->text   = 0;
+    Column *cols = d->cols + col;
+    p->tcol   = col;
+    p->tncols = (uint32_t)n;
+    p->sized  = 0;
+    if (p->stream == 0) {
+        p->table = TBL_FIXED;
+        for (int c = 0; c < n; c++)
+            if (cols[c].width < 3) cols[c].width = 3;
+    } else {
+        p->table = TBL_SIZING;
+        for (int c = 0; c < n; c++) cols[c].width = 3;
+    }
+    split_row(p, BK_TABLE, header, hlen);
+    return 1;
+}
+
+static void table_row(Parser *p, const char *line, size_t len)
+{
+    split_row(p, BK_TABLE_ROW, line, len);
+    if (p->table == TBL_SIZING && p->stream > 0
+        && ++p->sized >= p->stream)
+        p->table = TBL_FIXED;
+}
+
+static void table_end(Parser *p)
+{
+    doc_block(p->doc, BK_TABLE_END, NULL, 0, p->tncols)->col = (uint32_t)p->tcol;
+    p->table = TBL_NONE;
+}
+
+/*
+ * Emit a block for `line` with inline spans for line[text..len).  The
+ * lines of a paragraph, those that continue the one before (`cont`), are
+ * held back to be parsed as one; a heading is parsed at once.
+ */
+static void text_block(Parser *p, int kind, const char *line, size_t len,
+                       size_t text, int cont)
+{
+    Doc *d = p->doc;
+
+    if (p->paralines && !cont) para_end(p);
+    doc_block(d, kind, line, len, text)->cont = (unsigned char)cont;
+    if (kind == BK_HEADING) {
+        tokenize(d, line, text, len);
+        doc_end_block(d);
+        return;
+    }
+    if (!p->paralines) {
+        p->para = d->nblocks - 1;
+        inline_begin(d);
+    }
+    inline_scan(d, line, text, len);
+    doc_end_block(d);
+    if (++p->paralines == PARA_LINES) para_end(p);
+}
+
+static size_t lead_spaces(const char *s, size_t n)
+{
+    size_t i = 0;
+    while (i < n && s[i] == ' ') i++;
+    return i;
+}
+
+/* ---, *** or === (3+ chars, all the same) */
+static int is_hr(const char *s, size_t n)
+{
+    if (n < 3 || (s[0] != '-' && s[0] != '*' && s[0] != '=')) return 0;
+    for (size_t i = 1; i < n; i++)
+        if (s[i] != s[0]) return 0;
+    return 1;
+}
+
+/* Level of an ATX heading, or 0 */
+static size_t heading_level(const char *s, size_t n)
+{
+    size_t level = 0;
+    while (level < n && s[level] == '#') level++;
+    return level > 0 && level <= 6 && level < n && s[level] == ' ' ? level : 0;
+}
+
+/*
+ * A list marker at s: "-", "*" or "+", or up to 9 digits and ".", then a
+ * space.  Returns the length to the item's text (0: no marker) and the
+ * NS_* kind and number length.
+ */
+static size_t list_marker(const char *s, size_t n, int *kind, size_t *digits)
+{
+    if (n >= 2 && (s[0] == '-' || s[0] == '*' || s[0] == '+') && s[1] == ' '
+        && !is_hr(s, n)) {
+        *kind = NS_BULLET;
+        return 2;
+    }
+    size_t di = 0;
+    while (di < n && di < 9 && isdigit((unsigned char)s[di])) di++;
+    if (di > 0 && di + 1 < n && s[di] == '.' && s[di + 1] == ' ') {
+        *kind   = NS_ORDERED;
+        *digits = di;
+        return di + 2;
+    }
+    return 0;
+}
+
+/* True if s[0..n) would be a paragraph line, so it may continue one lazily */
+static int para_text(const char *s, size_t n)
+{
+    size_t sp = lead_spaces(s, n), digits;
+    int    kind;
+
+    if (sp == n || is_hr(s, n) || heading_level(s, n)
+        || (n >= 3 && memcmp(s, "```", 3) == 0))
+        return 0;
+    return sp > 3 || (s[sp] != '>' && !list_marker(s + sp, n - sp, &kind, &digits));
+}
+
+static uint32_t open_id(const Parser *p)
+{
+    return p->depth ? p->open[p->depth - 1].id : 0;
+}
+
+/* Close the containers from the m-th on, and fenced code in them. */
+static void nest_close(Parser *p, int m)
+{
+    Doc *d = p->doc;
+
+    if (p->in_fence && p->fence_depth > m) {
+        para_end(p);
+        doc_block(d, BK_FENCE_CLOSE, NULL, 0, 0)->level = 1;
+        p->in_fence = 0;
+    }
+    p->depth = m;
+    d->cur   = m ? p->open[m - 1].node + 1 : 0;
+}
+
+static void nest_open(Parser *p, int kind, size_t indent, const char *mark,
+                      size_t marklen)
+{
+    Doc  *d = p->doc;
+    Open *o = &p->open[p->depth++];
+
+    o->id      = ++p->ids;
+    o->node    = doc_nest(d, kind, o->id, mark ? (size_t)(mark - d->src) : 0, marklen);
+    o->kind    = (unsigned char)kind;
+    o->indent  = (unsigned char)indent;
+    o->marklen = (unsigned char)marklen;
+    d->cur     = o->node + 1;
+}
+
+/*
+ * Match `line` against the open containers and open those its markers
+ * start.  Returns the length of the container prefix; Doc.cur and
+ * Doc.fresh are set for the block of the rest.
+ */
+static size_t nest_line(Parser *p, const char *line, size_t len)
+{
+    size_t pos = 0;
+    int    m;
+
+    for (m = 0; m < p->depth; m++) {
+        size_t sp = lead_spaces(line + pos, len - pos);
+        if (p->open[m].kind == NS_QUOTE) {
+            if (sp > 3 || pos + sp == len || line[pos + sp] != '>') break;
+            pos += sp + 1;
+            if (pos < len && line[pos] == ' ') pos++;
+        } else if (pos + sp == len) {
+            pos = len;   /* a blank line stays in the item */
+        } else if (sp >= p->open[m].indent) {
+            pos += p->open[m].indent;
+        } else {
+            break;
+        }
+    }
+    if (m < p->depth) {
+        if (!p->in_fence && p->text && para_text(line + pos, len - pos))
+            return pos;   /* lazy continuation: stays in all of them */
+        nest_close(p, m);
+    }
+    if (p->in_fence) return pos;
+
+    int fresh = 0;
+    while (p->depth < NEST_MAX) {
+        size_t sp = lead_spaces(line + pos, len - pos), w, digits = 0;
+        int    kind;
+
+        if (sp > 3 || pos + sp == len) break;
+        const char *s = line + pos + sp;
+        if (*s == '>') {
+            nest_open(p, NS_QUOTE, 0, NULL, 0);
+            pos += sp + 1;
+            if (pos < len && line[pos] == ' ') pos++;
+        } else if ((w = list_marker(s, len - pos - sp, &kind, &digits))) {
+            nest_open(p, kind, sp + w, s, digits);
+            pos += sp + w;
+        } else {
+            break;
+        }
+        fresh++;
+    }
+    p->doc->fresh = (unsigned char)fresh;
+    return pos;
+}
+
+/* Classify what is left of a line after its container markers. */
+static void parse_block(Parser *p, const char *line, size_t len)
+{
+    Doc *d    = p->doc;
+    int  cont = p->text && !d->fresh && open_id(p) == p->textid;
+
+    p->text = 0;
+
+    /* ── fenced code block ──────────────────────────────────────────────── */
+    if (len >= 3 && memcmp(line, "```", 3) == 0) {
+        para_end(p);
+        p->in_fence    = !p->in_fence;
+        p->fence_depth = p->depth;
+        doc_block(d, p->in_fence ? BK_FENCE_OPEN : BK_FENCE_CLOSE, line, len, 3);
+        return;
+    }
+
+    if (p->in_fence) { doc_block(d, BK_FENCE_LINE, line, len, 0); return; }
+
+    /* ── blank line ─────────────────────────────────────────────────────── */
+    if (lead_spaces(line, len) == len) {
+        para_end(p);
+        doc_block(d, BK_BLANK, line, 0, 0);
+        return;
+    }
+
+    /* ── indented code: 4+ spaces, but not in a paragraph ───────────────── */
+    if (!cont && len > 4 && lead_spaces(line, 4) == 4) {
+        para_end(p);
+        doc_block(d, BK_CODE, line, len, 4);
+        return;
+    }
+
+    /* ── horizontal rule: ---, ***, === (3+ chars, all same) ────────────── */
+    if (is_hr(line, len)) {
+        para_end(p);
+        doc_block(d, BK_HR, line, len, len);
+        return;
+    }
+
+    /* ── headings ───────────────────────────────────────────────────────── */
+    size_t level = heading_level(line, len);
+    if (level) {
+        text_block(p, BK_HEADING, line, len, level + 1, 0);
+        d->blocks[d->nblocks - 1].level = (unsigned char)level;
+        return;
+    }
+
+    /* ── paragraph line, in whatever containers it is ───────────────────── */
+    text_block(p, BK_PARA, line, len, 0, cont);
+    p->text   = 1;
+    p->textid = open_id(p);
+}
+
+static void parse_line(Parser *p, const char *line, size_t len)
+{
+    /* resolve the lookahead: table header + separator, or a plain line */
+    if (p->have_pending) {
+        p->have_pending = 0;
+        if (len > 0 && line[0] == '|'
+            && table_start(p, p->doc->src + p->pending, p->pendlen, line, len))
+            return;
+        parse_block(p, p->doc->src + p->pending, p->pendlen);
+    }
+
+    if (p->table != TBL_NONE) {
+        if (len == 0) { table_end(p); return; }   /* blank line ends table */
+        if (line[0] == '|') { table_row(p, line, len); return; }
+        table_end(p);
+    }
+
+    size_t pre = nest_line(p, line, len);
+    line += pre;
+    len  -= pre;
+
+    /* ── table: pipe-prefixed line followed by separator ────────────────── */
+    if (!p->in_fence && p->depth == 0 && len > 0 && line[0] == '|') {
+        p->pending      = (size_t)(line - p->doc->src);
+        p->pendlen      = len;
+        p->have_pending = 1;
+        return;
+    }
+
+    parse_block(p, line, len);
+}
+
+/*
+ * Empty the IR once it has been rendered.  An open streaming table keeps
+ * its columns, moved to the front.
+ */
+static void parser_reset(Parser *p)
+{
+    Doc *d = p->doc;
+
+    d->nblocks = 0;
+    d->nspans  = 0;
+    d->ncols   = 0;
+    d->nnest   = 0;
+    d->cur     = 0;
+    for (int i = 0; i < p->depth; i++) {   /* the open containers, again */
+        Open *o = &p->open[i];
+        o->node = doc_nest(d, o->kind, o->id, 0, o->marklen);
+        d->cur  = o->node + 1;
+    }
+    if (p->table != TBL_NONE) {
+        if (p->tncols) memmove(d->cols, d->cols + p->tcol, p->tncols * sizeof *d->cols);
+        p->tcol  = 0;
+        d->ncols = p->tncols;
+    }
+}
+
+/* End of input: flush the lookahead and close any open block. */
+static void parse_finish(Parser *p)
+{
+    if (p->have_pending) {
+        p->have_pending = 0;
+        parse_block(p, p->doc->src + p->pending, p->pendlen);
+    }
+    para_end(p);
+    if (p->table != TBL_NONE) table_end(p);
+    if (p->in_fence) {
+        doc_block(p->doc, BK_FENCE_CLOSE, NULL, 0, 0)->level = 1;
+        p->in_fence = 0;
+    }
+    nest_close(p, 0);
+}
+
+/* ── Syntax highlighting ─────────────────────────────────────────────────── */
+/*
+ * Fenced code whose info string names a known language is coloured by a
+ * one-pass lexer: a character-class table drives the scan and identifiers
+ * are looked up in a per-language keyword hash, both built once.  Nothing
+ * backtracks.  The only state carried from one line to the next is an
+ * open block comment or triple-quoted string (Out.hl_state); fences never
+ * straddle -j chunks, so that state stays within one Out.
+ */
+
+enum { HL_C, HL_PYTHON, HL_SHELL, HL_JSON, HL_YAML, HL_DIFF, HL_NLANGS };
+
+#define LX_HASH     0x01   /* '#' at a word start opens a comment */
+#define LX_SLASH    0x02   /* // and slash-star comments */
+#define LX_PREPROC  0x04   /* '#' directives */
+#define LX_TRIPLE   0x08   /* """ and ''' strings */
+#define LX_VARS     0x10   /* $name and ${...} */
+#define LX_KEYS     0x20   /* "key": (JSON) and key: (YAML) */
+#define LX_DECOR    0x40   /* @decorators */
+#define LX_SQ_RAW   0x80   /* no escapes in '...' */
+#define LX_SQ_WORD  0x100  /* ' opens a string only at a token start */
+
+typedef struct {
+    const char *names;      /* info strings, space-separated */
+    const char *keywords;   /* space-separated */
+    const char *quotes;
+    unsigned    flags;
+} Lang;
+
+static const Lang langs[HL_NLANGS] = {
+    [HL_C] = { "c h cc cpp cxx c++ hh hpp hxx",
+        "alignas alignof asm auto bool break case catch char class const "
+        "const_cast constexpr continue decltype default delete do double "
+        "dynamic_cast else enum explicit extern false final float for friend "
+        "goto if inline int int8_t int16_t int32_t int64_t long mutable "
+        "namespace new noexcept nullptr operator override private protected "
+        "public register reinterpret_cast restrict return short signed "
+        "size_t sizeof ssize_t static static_assert static_cast struct switch "
+        "template this throw true try typedef typename uint8_t uint16_t "
+        "uint32_t uint64_t union unsigned using virtual void volatile while "
+        "NULL _Bool",
+        "\"'", LX_SLASH | LX_PREPROC },
+    [HL_PYTHON] = { "py python python3",
+        "False None True and as assert async await break class continue def "
+        "del elif else except finally for from global if import in is lambda "
+        "nonlocal not or pass raise return self try while with yield",
+        "\"'", LX_HASH | LX_TRIPLE | LX_DECOR },
+    [HL_SHELL] = { "sh bash zsh ksh shell console",
+        "alias break case cd continue declare do done echo elif else esac "
+        "eval exec exit export fi for function if in local printf read "
+        "readonly return select set shift source then trap unset until while",
+        "\"'", LX_HASH | LX_VARS | LX_SQ_RAW },
+    [HL_JSON] = { "json jsonc", "true false null", "\"", LX_KEYS },
+    [HL_YAML] = { "yaml yml",
+        "true false null yes no on off True False Null Yes No On Off",
+        "\"'", LX_HASH | LX_KEYS | LX_SQ_RAW | LX_SQ_WORD },
+    [HL_DIFF] = { "diff patch", "", "", 0 },
+};
+
+#define CL_SPACE  0x1
+#define CL_IDENT  0x2   /* may continue an identifier */
+#define CL_START  0x4   /* may start one */
+#define CL_DIGIT  0x8
+
+#define KW_SLOTS 256    /* per language, a power of two; at most half full */
+
+static unsigned char hl_class[256];
+static uint32_t      hl_kw[HL_NLANGS][KW_SLOTS];   /* offset << 8 | length */
+
+static unsigned kw_hash(const char *s, size_t n)
+{
+    return ((unsigned char)s[0] * 33u + (unsigned char)s[n - 1] * 7u
+            + (unsigned)n * 5u) & (KW_SLOTS - 1);
+}
+
+static void hl_build(void)
+{
+    for (int c = 0; c < 256; c++) {
+        if (c == ' ' || c == '\t' || c == '\r') hl_class[c] |= CL_SPACE;
+        if (isalpha(c) || c == '_' || c >= 0x80) hl_class[c] |= CL_START | CL_IDENT;
+        if (isdigit(c)) hl_class[c] |= CL_DIGIT | CL_IDENT;
+    }
+    for (int l = 0; l < HL_NLANGS; l++) {
+        const char *kw = langs[l].keywords;
+        for (size_t i = 0; kw[i]; ) {
+            size_t n = strcspn(kw + i, " ");
+            unsigned h = kw_hash(kw + i, n);
+            while (hl_kw[l][h]) h = (h + 1) & (KW_SLOTS - 1);
+            hl_kw[l][h] = (uint32_t)i << 8 | (uint32_t)n;
+            i += n + (kw[i + n] == ' ');
+        }
+    }
+}
+
+/* True if `theme` styles any token, so that lexing is worth it */
+static int hl_styled(const uint32_t *theme)
+{
+    for (int r = A_HL_KEYWORD; r <= A_HL_DEL; r++)
+        if (theme[r]) return 1;
+    return 0;
+}
+
+/* The language named by a fence's info string, or -1 */
+static int hl_lang(const char *info, size_t n)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    while (n > 0 && (*info == ' ' || *info == '\t')) { info++; n--; }
+    size_t w = 0;
+    while (w < n && info[w] != ' ' && info[w] != '\t' && info[w] != '{') w++;
+    if (w == 0) return -1;
+
+    pthread_once(&once, hl_build);
+    for (int l = 0; l < HL_NLANGS; l++) {
+        for (const char *s = langs[l].names; *s; ) {
+            size_t k = strcspn(s, " ");
+            if (k == w) {
+                size_t i = 0;
+                while (i < w && tolower((unsigned char)info[i]) == s[i]) i++;
+                if (i == w) return l;
+            }
+            s += k + (s[k] == ' ');
+        }
+    }
+    return -1;
+}
+
+static int hl_keyword(int lang, const char *s, size_t n)
+{
+    if (n > 24) return 0;
+    for (unsigned h = kw_hash(s, n); hl_kw[lang][h]; h = (h + 1) & (KW_SLOTS - 1)) {
+        uint32_t e = hl_kw[lang][h];
+        if ((e & 0xFF) == n && memcmp(langs[lang].keywords + (e >> 8), s, n) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Output of hl_line(): a run of bytes in one role is printed when the
+ * next role begins, so neighbouring tokens in the same role (plain text
+ * and spaces, mostly) cost one write.
+ */
+typedef struct {
+    Out        *o;
+    const char *s;
+    size_t      from;   /* start of the open run */
+    int         role;
+} HlRun;
+
+/* s[at..) is in role `role` */
+static inline void hl_mark(HlRun *r, size_t at, int role)
+{
+    if (role == r->role || at == r->from) { r->role = role; return; }
+    ansi(r->o, A_RESET);
+    ansi(r->o, A_FENCE);
+    if (r->role != A_RESET) ansi(r->o, r->role);
+    out_write(r->o, r->s + r->from, at - r->from);
+    r->from = at;
+    r->role = role;
+}
+
+/*
+ * End of a string in s[i..n) closed by quote `q` (three of them when
+ * `triple`).  Sets *open when the line ends first.
+ */
+static size_t hl_string(const Lang *lg, const char *s, size_t i, size_t n,
+                        char q, int triple, int *open)
+{
+    int escapes = !(q == '\'' && (lg->flags & LX_SQ_RAW));
+
+    *open = 0;
+    while (i < n) {
+        if (s[i] == '\\' && escapes) { i += 2; continue; }
+        if (s[i++] != q) continue;
+        if (!triple) return i;
+        if (i + 1 < n && s[i] == q && s[i + 1] == q) return i + 2;
+    }
+    *open = 1;
+    return n;
+}
+
+/* End of a block comment in s[i..n); sets *open when the line ends first. */
+static size_t hl_comment(const char *s, size_t i, size_t n, int *open)
+{
+    for (; i + 1 < n; i++)
+        if (s[i] == '*' && s[i + 1] == '/') { *open = 0; return i + 2; }
+    *open = 1;
+    return n;
+}
+
+enum { HS_NONE, HS_COMMENT, HS_TRIPLE_DQ, HS_TRIPLE_SQ };
+
+/* One line of fenced code in language `o->hl` */
+static void hl_line(Out *o, const char *s, size_t n)
+{
+    const Lang *lg    = &langs[o->hl];
+    unsigned    flags = lg->flags;
+    size_t      i = 0, j;
+    int         open = 0;
+    HlRun       r = { o, s, 0, A_RESET };
+
+    if (o->hl == HL_DIFF) {
+        int role = A_RESET;
+        if ((n >= 3 && (memcmp(s, "+++", 3) == 0 || memcmp(s, "---", 3) == 0))
+            || (n >= 2 && memcmp(s, "@@", 2) == 0)
+            || (n >= 5 && memcmp(s, "diff ", 5) == 0)
+            || (n >= 6 && memcmp(s, "index ", 6) == 0))
+            role = A_HL_META;
+        else if (n > 0 && s[0] == '+') role = A_HL_ADD;
+        else if (n > 0 && s[0] == '-') role = A_HL_DEL;
+        hl_mark(&r, 0, role);
+        hl_mark(&r, n, -1);
+        return;
+    }
+
+    /* carried over from the previous line */
+    if (o->hl_state == HS_COMMENT) {
+        hl_mark(&r, 0, A_HL_COMMENT);
+        i = hl_comment(s, 0, n, &open);
+    } else if (o->hl_state != HS_NONE) {
+        hl_mark(&r, 0, A_HL_STRING);
+        i = hl_string(lg, s, 0, n, o->hl_state == HS_TRIPLE_DQ ? '"' : '\'', 1, &open);
+    }
+    if (!open) o->hl_state = HS_NONE;
+
+    /* line-start forms: directives, decorators, YAML keys */
+    j = i;
+    while (j < n && (hl_class[(unsigned char)s[j]] & CL_SPACE)) j++;
+    if (j < n && o->hl_state == HS_NONE) {
+        if (((flags & LX_PREPROC) && s[j] == '#') || ((flags & LX_DECOR) && s[j] == '@')) {
+            size_t k = j + 1;
+            while (k < n && (hl_class[(unsigned char)s[k]] & CL_SPACE)) k++;
+            while (k < n && ((hl_class[(unsigned char)s[k]] & CL_IDENT) || s[k] == '.')) k++;
+            hl_mark(&r, i, A_RESET);
+            hl_mark(&r, j, A_HL_META);
+            i = k;
+            if (s[j] == '#') {   /* #include <file> */
+                while (k < n && s[k] == ' ') k++;
+                if (k < n && s[k] == '<') {
+                    size_t e = k;
+                    while (e < n && s[e] != '>') e++;
+                    e += e < n;
+                    hl_mark(&r, i, A_RESET);
+                    hl_mark(&r, k, A_HL_STRING);
+                    i = e;
+                }
+            }
+        } else if (o->hl == HL_YAML) {
+            while (j + 1 < n && s[j] == '-' && s[j + 1] == ' ') j += 2;
+            size_t k = j;
+            if (k < n && s[k] != '"' && s[k] != '\''
+                && s[k] != '{' && s[k] != '[')
+                while (k < n && s[k] != ':' && s[k] != '#') k++;
+            if (k > j && k < n && s[k] == ':' && (k + 1 == n || s[k + 1] == ' ')) {
+                hl_mark(&r, i, A_RESET);
+                hl_mark(&r, j, A_HL_KEY);
+                i = k;
+            }
+        }
+    }
+
+    while (i < n) {
+        unsigned char c   = (unsigned char)s[i];
+        unsigned      cls = hl_class[c];
+        int           at_word = i == 0 || (hl_class[(unsigned char)s[i - 1]] & CL_SPACE);
+        int           role = A_RESET;
+        size_t        e = i + 1;
+
+        if (cls & CL_START) {
+            while (e < n && (hl_class[(unsigned char)s[e]] & CL_IDENT)) e++;
+            if (hl_keyword(o->hl, s + i, e - i)) role = A_HL_KEYWORD;
+        } else if (cls & CL_DIGIT) {
+            while (e < n && ((hl_class[(unsigned char)s[e]] & CL_IDENT) || s[e] == '.')) e++;
+            role = A_HL_NUMBER;
+        } else if (cls & CL_SPACE) {
+            while (e < n && (hl_class[(unsigned char)s[e]] & CL_SPACE)) e++;
+        } else if ((c == '#' && (flags & LX_HASH) && at_word)
+                   || (c == '/' && (flags & LX_SLASH) && e < n && s[e] == '/')) {
+            e    = n;
+            role = A_HL_COMMENT;
+        } else if (c == '/' && (flags & LX_SLASH) && e < n && s[e] == '*') {
+            e = hl_comment(s, i + 2, n, &open);
+            if (open) o->hl_state = HS_COMMENT;
+            role = A_HL_COMMENT;
+        } else if (c == '$' && (flags & LX_VARS) && e < n) {
+            if (s[e] == '{') {
+                while (e < n && s[e] != '}') e++;
+                e += e < n;
+            } else if (hl_class[(unsigned char)s[e]] & CL_IDENT) {
+                while (e < n && (hl_class[(unsigned char)s[e]] & CL_IDENT)) e++;
+            } else if (s[e] && strchr("@#?$!*-", s[e])) {
+                e++;
+            }
+            role = e > i + 1 ? A_HL_META : A_RESET;
+        } else if (c != '\0' && strchr(lg->quotes, c)
+                   && !(c == '\'' && (flags & LX_SQ_WORD) && !at_word
+                        && !strchr(":[{,-", s[i - 1]))) {
+            if ((flags & LX_TRIPLE) && i + 2 < n && s[i + 1] == c && s[i + 2] == c) {
+                e = hl_string(lg, s, i + 3, n, (char)c, 1, &open);
+                if (open) o->hl_state = c == '"' ? HS_TRIPLE_DQ : HS_TRIPLE_SQ;
+            } else {
+                e = hl_string(lg, s, i + 1, n, (char)c, 0, &open);
+            }
+            role = A_HL_STRING;
+            if (flags & LX_KEYS) {   /* "key": */
+                size_t k = e;
+                while (k < n && (hl_class[(unsigned char)s[k]] & CL_SPACE)) k++;
+                if (k < n && s[k] == ':') role = A_HL_KEY;
+            }
+        }
+        hl_mark(&r, i, role);
+        i = e;
+    }
+    hl_mark(&r, n, -1);
+}
+
+/* ── ANSI renderer ───────────────────────────────────────────────────────── */
+
+/* Emit the sequences that (re)start inline span state `state` */
+static void span_on(Out *o, int state)
+{
+    if (state & SPAN_BOLD)   ansi(o, A_BOLD);
+    if (state & SPAN_ITALIC) ansi(o, A_ITALIC);
+}
+
+/* Go from span state `from` to `to`; dropping a style takes a reset */
+static void span_move(Out *o, int from, int to)
+{
+    if (from & ~to) ansi(o, A_RESET);
+    span_on(o, to);
+}
+
+/*
+ * Render a run of inline spans of `line` using at most `maxw` visible
+ * columns (no limit when maxw < 0).  Returns how many of those columns
+ * were left unused, which a wide character that did not fit can make
+ * non-zero even when the text was clipped.
+ */
+static int render_spans(Out *o, const char *line, const Span *sp, size_t n,
+                        int maxw)
+{
+    int state   = SPAN_NONE;   /* current active span */
+    int room    = maxw;
+    int clipped = 0;
+
+    for (size_t k = 0; k < n && !clipped; k++) {
+        const char *s = line + sp[k].off;
+        size_t      len = sp[k].len;
+
+        switch (sp[k].kind) {
+        case SP_TEXT:
+            if (maxw < 0) {
+                out_write(o, s, len);
+            } else {
+                size_t b = utf8_prefix(s, len, &room);
+                out_write(o, s, b);
+                if (b < len) clipped = 1;
+            }
+            break;
+
+        case SP_CODE:
+            if (room == 0) { clipped = 1; break; }
+            ansi(o, A_CODE);
+            out_putc(o, ' ');
+            if (maxw < 0) {
+                out_write(o, s, len);
+                out_putc(o, ' ');
+            } else {
+                room--;
+                size_t b = utf8_prefix(s, len, &room);
+                out_write(o, s, b);
+                if (b < len || room == 0) {
+                    ansi(o, A_RESET);
+                    clipped = 1;
+                    break;
+                }
+                out_putc(o, ' ');
+                room--;
+            }
+            ansi(o, A_RESET);
+            span_on(o, state);   /* restore active span */
+            break;
+
+        case SP_STYLE:
+            span_move(o, state, sp[k].style);
+            state = sp[k].style;
+            break;
+        }
+    }
+
+    /* close any unclosed span */
+    if (state != SPAN_NONE) ansi(o, A_RESET);
+    return room;
+}
+
+/* render_spans() for plain output: styles are no-ops, text copies through */
+static void render_spans_plain(Out *o, const char *line, const Span *sp,
+                               size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        if (sp[k].kind == SP_TEXT) {
+            out_bytes(o, line + sp[k].off, sp[k].len);
+        } else if (sp[k].kind == SP_CODE) {
+            out_bytes(o, " ", 1);
+            out_bytes(o, line + sp[k].off, sp[k].len);
+            out_bytes(o, " ", 1);
+        }
+    }
+}
+
+/* Render the inline text of a block. */
+static void render_text(Out *o, const Doc *d, const Block *b)
+{
+    const char *line = d->src + b->off;
+    const Span *sp   = d->spans + b->span;
+
+    if (o->theme == theme_plain) render_spans_plain(o, line, sp, b->nspans);
+    else                         render_spans(o, line, sp, b->nspans, -1);
+}
+
+/*
+ * Print exactly `w` visible characters of a cell (whose visible width is
+ * `vlen`), padding with spaces.  Text wider than the column is cut off
+ * with '…'.
+ */
+static void print_cell(Out *o, const char *line, const Span *sp, size_t n,
+                       int vlen, int w, Align align)
+{
+    if (vlen > w) {
+        int left = render_spans(o, line, sp, n, w - 1);
+        out_puts(o, "\xe2\x80\xa6");   /* … */
+        out_repeat(o, " ", 1, (size_t)left);
+        return;
+    }
+    int pad  = w - vlen;
+
+    int lpad = 0, rpad = pad;
+    if (align == ALIGN_CENTER) { lpad = pad / 2; rpad = pad - lpad; }
+    else if (align == ALIGN_RIGHT) { lpad = pad; rpad = 0; }
+
+    out_repeat(o, " ", 1, (size_t)lpad);
+    if (o->theme == theme_plain) render_spans_plain(o, line, sp, n);
+    else                         render_spans(o, line, sp, n, -1);
+    out_repeat(o, " ", 1, (size_t)rpad);
+}
+
+/*
+ * Tables are laid out to fit the width when one is set.  table_fit() gives
+ * every column its widest cell if the table fits; otherwise it shares the
+ * room out in proportion to those widths, with no column below
+ * TABLE_MIN_COL (or its widest cell, if narrower).  A cell wider than its
+ * column (also one past the sized rows of a streaming table) is wrapped at
+ * spaces onto as many lines as it needs, splitting only words that are too
+ * wide.  The layout lives in the Out, so a streaming table keeps it across
+ * batches, and the array only grows when a table has more columns.
+ */
+
+#define TABLE_MIN_COL 8
+
+typedef struct TableCol {
+    int         width;    /* columns of text, padding excluded */
+    int         done;     /* width is settled; render_row(): the cell has
+                             no more lines */
+    const Span *sp;       /* render_row(): the cell's spans */
+    size_t      n;
+    int         vlen;     /*               and its width */
+    size_t      k, i;     /* next to print: byte i of span k */
+    int         state;    /* span state there */
+} TableCol;
+
+static void table_fit(Out *o, const Column cols[], uint32_t ncols)
+{
+    if (ncols > o->tcolcap) {
+        o->tcolcap = ncols;
+        o->tcol    = xrealloc(o->tcol, ncols * sizeof *o->tcol);
+    }
+    o->ntcol = ncols;
+
+    TableCol *tc   = o->tcol;
+    long      room = (long)o->width - 3 * (long)ncols - 1;   /* "│ " .. " │" */
+    long      want = 0;
+    for (uint32_t c = 0; c < ncols; c++) {
+        tc[c].width = cols[c].width;
+        want += cols[c].width;
+    }
+    if (o->width <= 0 || want <= room || room < 3 * (long)ncols) return;
+
+    /* Columns whose proportional share is below their minimum get the
+     * minimum; the rest share what is left, again in proportion. */
+    for (uint32_t c = 0; c < ncols; c++) tc[c].done = 0;
+    for (int again = 1; again && want > 0; ) {
+        again = 0;
+        for (uint32_t c = 0; c < ncols; c++) {
+            int min = cols[c].width < TABLE_MIN_COL ? cols[c].width : TABLE_MIN_COL;
+            if (tc[c].done || (room > 0 && (long)cols[c].width * room / want >= min))
+                continue;
+            tc[c].width = min;
+            tc[c].done  = 1;
+            room -= min;
+            want -= cols[c].width;
+            again = 1;
+        }
+    }
+    long left = room;
+    for (uint32_t c = 0; c < ncols; c++) {
+        if (tc[c].done) continue;
+        tc[c].width = (int)((long)cols[c].width * room / want);
+        left -= tc[c].width;
+    }
+    for (uint32_t c = 0; left > 0 && c < ncols; c++)
+        if (!tc[c].done) { tc[c].width++; left--; }
+}
+
+/* Move a wrapped cell past the spaces it broke at; done if nothing is left */
+static void cell_skip(const char *line, TableCol *t)
+{
+    const Span *sp = t->sp;
+    size_t      k  = t->k, i = t->i;
+
+    for (; k < t->n; k++, i = 0) {
+        if (sp[k].kind == SP_STYLE) { t->state = sp[k].style; continue; }
+        if (sp[k].kind == SP_TEXT) {
+            const char *s = line + sp[k].off;
+            while (i < sp[k].len && s[i] == ' ') i++;
+            if (i == sp[k].len) continue;
+        }
+        break;
+    }
+    t->k = k; t->i = i;
+    t->done = k == t->n;
+}
+
+/*
+ * Print the next line of a wrapped cell in exactly t->width columns and
+ * move past it.  Inline code is never split; code wider than the column
+ * is cut off with '…'.
+ */
+static void cell_line(Out *o, const char *line, TableCol *t, Align align)
+{
+    const Span *sp = t->sp;
+    size_t      n  = t->n, k = t->k, i = t->i;
+    int         w  = t->width;
+
+    if (sp[k].kind == SP_CODE && (int)sp[k].width > w) {
+        int left = render_spans(o, line, sp + k, 1, w - 1);
+        out_puts(o, "\xe2\x80\xa6");   /* … */
+        out_repeat(o, " ", 1, (size_t)left);
+        t->k = k + 1; t->i = 0;
+        cell_skip(line, t);
+        return;
+    }
+
+    /* find the end: the last space that fits, or where the room runs out */
+    size_t ek = n, ei = 0, bk = n, bi = 0;
+    int    col = 0, bcol = -1;
+    for (; k < n; k++, i = 0) {
+        if (sp[k].kind == SP_CODE) {
+            if (col + (int)sp[k].width > w) { ek = k; ei = 0; break; }
+            col += (int)sp[k].width;
+            continue;
+        }
+        if (sp[k].kind != SP_TEXT) continue;
+        const char *s = line + sp[k].off;
+        while (i < sp[k].len) {
+            int    cw;
+            size_t cl = utf8_char(s + i, sp[k].len - i, &cw);
+            if (s[i] == ' ' && col > 0) { bk = k; bi = i; bcol = col; }
+            if (col + cw > w && col > 0) { ek = k; ei = i; goto found; }
+            col += cw;
+            i   += cl;
+        }
+    }
+found:
+    if (ek < n && bcol >= 0) { ek = bk; ei = bi; col = bcol; }
+
+    int pad = w - col, lpad = 0;
+    if (align == ALIGN_CENTER)     lpad = pad / 2;
+    else if (align == ALIGN_RIGHT) lpad = pad;
+    out_repeat(o, " ", 1, (size_t)lpad);
+
+    int state = t->state;
+    span_on(o, state);
+    for (k = t->k, i = t->i; k < ek || (k == ek && i < ei); k++, i = 0) {
+        const char *s = line + sp[k].off;
+        if (sp[k].kind == SP_TEXT) {
+            out_write(o, s + i, (k < ek ? sp[k].len : ei) - i);
+        } else if (sp[k].kind == SP_CODE) {
+            ansi(o, A_CODE);
+            out_putc(o, ' ');
+            out_write(o, s, sp[k].len);
+            out_putc(o, ' ');
+            ansi(o, A_RESET);
+            span_on(o, state);
+        } else {
+            span_move(o, state, sp[k].style);
+            state = sp[k].style;
+        }
+    }
+    if (state != SPAN_NONE) ansi(o, A_RESET);
+    out_repeat(o, " ", 1, (size_t)(pad - lpad));
+    t->k = ek; t->i = ei; t->state = state;
+    cell_skip(line, t);
+}
+
+/* Horizontal rule for table borders using box-drawing chars */
+static void table_hline(Out *o)
+{
+    ansi(o, A_BORDER);
+    /* left corner or T-junction */
+    out_puts(o, "\xe2\x94\x9c");   /* ├ */
+    for (uint32_t c = 0; c < o->ntcol; c++) {
+        out_repeat(o, "\xe2\x94\x80", 3, (size_t)o->tcol[c].width + 2);   /* ─ */
+        if (c < o->ntcol - 1) out_puts(o, "\xe2\x94\xbc");  /* ┼ */
+        else                  out_puts(o, "\xe2\x94\xa4");  /* ┤ */
+    }
+    ansi(o, A_RESET);
+    out_putc(o, '\n');
+}
+
+static void table_topline(Out *o)
+{
+    ansi(o, A_BORDER);
+    out_puts(o, "\xe2\x94\x8c");   /* ┌ */
+    for (uint32_t c = 0; c < o->ntcol; c++) {
+        out_repeat(o, "\xe2\x94\x80", 3, (size_t)o->tcol[c].width + 2);
+        if (c < o->ntcol - 1) out_puts(o, "\xe2\x94\xac");  /* ┬ */
+        else                  out_puts(o, "\xe2\x94\x90");  /* ┐ */
+    }
+    ansi(o, A_RESET);
+    out_putc(o, '\n');
+}
+
+static void table_botline(Out *o)
+{
+    ansi(o, A_BORDER);
+    out_puts(o, "\xe2\x94\x94");   /* └ */
+    for (uint32_t c = 0; c < o->ntcol; c++) {
+        out_repeat(o, "\xe2\x94\x80", 3, (size_t)o->tcol[c].width + 2);
+        if (c < o->ntcol - 1) out_puts(o, "\xe2\x94\xb4");  /* ┴ */
+        else                  out_puts(o, "\xe2\x94\x98");  /* ┘ */
+    }
+    ansi(o, A_RESET);
+    out_putc(o, '\n');
+}
+
+static void render_row(Out *o, const Doc *d, const Block *b, int is_header)
+{
+    const char   *line = d->src + b->off;
+    const Span   *sp   = d->spans + b->span;
+    const Span   *end  = sp + b->nspans;
+    const Column *cols = d->cols + b->col;
+    TableCol     *tc   = o->tcol;
+    int           wrap = 0;
+
+    for (uint32_t c = 0; c < b->text; c++) {
+        const Span *cell = sp++;          /* SP_CELL */
+        tc[c].sp = sp;
+        while (sp < end && sp->kind != SP_CELL) sp++;
+        tc[c].n     = (size_t)(sp - tc[c].sp);
+        tc[c].vlen  = (int)cell->width;
+        tc[c].k     = tc[c].i = 0;
+        tc[c].state = SPAN_NONE;
+        tc[c].done  = 1;
+        if (tc[c].vlen > tc[c].width) cell_skip(line, &tc[c]);
+        if (!tc[c].done) wrap = 1;
+    }
+
+    /* one line per row unless a cell wraps; a cell that fits takes the
+     * first line and pads the others */
+    for (int first = 1; first || wrap; first = 0) {
+        wrap = 0;
+        ansi(o, A_BORDER); out_puts(o, "\xe2\x94\x82"); ansi(o, A_RESET);  /* │ */
+        for (uint32_t c = 0; c < b->text; c++) {
+            out_putc(o, ' ');
+            if (is_header) ansi(o, A_TH);
+            if (!tc[c].done) {
+                cell_line(o, line, &tc[c], cols[c].align);
+            } else if (first) {
+                print_cell(o, line, tc[c].sp, tc[c].n, tc[c].vlen,
+                           tc[c].width, cols[c].align);
+            } else {
+                out_repeat(o, " ", 1, (size_t)tc[c].width);
+            }
+            if (is_header) ansi(o, A_RESET);
+            out_putc(o, ' ');
+            ansi(o, A_BORDER); out_puts(o, "\xe2\x94\x82"); ansi(o, A_RESET);  /* │ */
+            if (!tc[c].done) wrap = 1;
+        }
+        out_putc(o, '\n');
+    }
+}
+
+/* ── Containers ─────────────────────────────────────────────────────────── */
+/*
+ * A block in quotes and list items is drawn after a prefix, outermost
+ * container first: a bar for a quote, the marker for an item whose first
+ * line this is, and spaces as wide as the marker for its other lines.
+ * Bullets cycle through • ◦ ▪ with the depth of the list.
+ */
+
+enum { PF_FIRST, PF_CONT, PF_BLANK };
+
+static const char *const bullet_glyph[] = {
+    "\xe2\x80\xa2 ", "\xe2\x97\xa6 ", "\xe2\x96\xaa ",   /* • ◦ ▪ */
+};
+
+/* The containers of b, outermost first; returns how many */
+static int nest_path(const Doc *d, const Block *b, const Nest *path[NEST_MAX])
+{
+    int n = 0;
+
+    for (uint32_t k = b->nest; k; k = d->nest[k - 1].parent) n++;
+    for (uint32_t k = b->nest, i = (uint32_t)n; k; k = d->nest[k - 1].parent)
+        path[--i] = &d->nest[k - 1];
+    return n;
+}
+
+static void quote_bar(Out *o)
+{
+    ansi(o, A_QUOTE_BAR);
+    out_puts(o, "\xe2\x94\x82 ");   /* │ */
+    ansi(o, A_RESET);
+}
+
+/*
+ * Draw the prefix of block b: PF_FIRST with the markers of the items it
+ * starts, PF_CONT as for a later line, PF_BLANK for an empty line, which
+ * needs no more than the quote bars.  Leaves the continuation form in
+ * o->pfx, its width in o->indent and whether a quote is in it in o->quote.
+ */
+static void nest_prefix(Out *o, const Doc *d, const Block *b, int how)
+{
+    const Nest *path[NEST_MAX];
+    int         n = nest_path(d, b, path), bars = 0, lists = 0;
+
+    for (int i = 0; i < n; i++)
+        if (path[i]->kind == NS_QUOTE) bars = i + 1;
+
+    o->npfx = n;
+    o->indent = o->quote = 0;
+    for (int i = 0; i < n; i++) {
+        const Nest *t    = path[i];
+        int         draw = how != PF_BLANK || i < bars;
+
+        if (t->kind == NS_QUOTE) {
+            o->pfx[i] = 0;
+            o->indent += 2;
+            o->quote = 1;
+            if (draw) quote_bar(o);
+            continue;
+        }
+        int w = t->kind == NS_BULLET ? 4 : t->marklen + 4;
+        o->pfx[i] = (unsigned char)w;
+        o->indent += w;
+        lists++;
+        if (how == PF_FIRST && i >= n - b->fresh) {
+            out_puts(o, "  ");
+            ansi(o, A_MARKER);
+            if (t->kind == NS_BULLET) {
+                out_puts(o, bullet_glyph[(lists - 1) % 3]);
+            } else {
+                out_write(o, d->src + t->mark, t->marklen);
+                out_puts(o, ". ");
+            }
+            ansi(o, A_RESET);
+        } else if (draw) {
+            out_repeat(o, " ", 1, (size_t)w);
+        }
+    }
+}
+
+/* Draw the continuation prefix kept by nest_prefix() */
+static void pfx_draw(Out *o)
+{
+    for (int i = 0; i < o->npfx; i++) {
+        if (o->pfx[i]) out_repeat(o, " ", 1, o->pfx[i]);
+        else           quote_bar(o);
+    }
+}
+
+/* Columns of a block's rendered text: its spans less the emphasis markers */
+static size_t text_cols(const Doc *d, const Block *b)
+{
+    const Span *sp = d->spans + b->span;
+    size_t      w  = 0;
+
+    for (uint32_t k = 0; k < b->nspans; k++)
+        if (sp[k].kind != SP_STYLE) w += sp[k].width;
+    return w;
+}
+
+static void render_hr(Out *o)
+{
+    ansi(o, A_HR);
+    out_repeat(o, "\xe2\x94\x80", 3,
+               o->width > o->indent ? (size_t)(o->width - o->indent) : 60);   /* ─ */
+    ansi(o, A_RESET);
+    out_putc(o, '\n');
+}
+
+static void render_block(Out *o, const Doc *d, const Block *b)
+{
+    const char *line = d->src + b->off;
+
+    if (b->kind != BK_HEADING && b->kind != BK_FENCE_CLOSE)   /* after a blank line */
+        nest_prefix(o, d, b, b->kind == BK_BLANK && !b->fresh ? PF_BLANK : PF_FIRST);
+
+    switch (b->kind) {
+    case BK_FENCE_OPEN:
+        o->hl       = hl_styled(o->theme) ? hl_lang(line + 3, b->len - 3) : -1;
+        o->hl_state = 0;
+        ansi(o, A_FENCE_OPEN);
+        if (b->len > 3) {
+            ansi(o, A_FENCE_LANG);
+            out_putc(o, '[');
+            out_write(o, line + 3, b->len - 3);
+            out_putc(o, ']');
+            out_putc(o, '\n');
+            ansi(o, A_RESET);
+        } else {
+            out_putc(o, '\n');
+        }
+        break;
+
+    case BK_FENCE_CLOSE:
+        o->hl = -1;
+        ansi(o, A_RESET);
+        if (!b->level) {
+            nest_prefix(o, d, b, PF_BLANK);
+            out_putc(o, '\n');
+        }
+        break;
+
+    case BK_FENCE_LINE:
+        ansi(o, A_FENCE);
+        out_puts(o, "  ");
+        if (o->hl >= 0) hl_line(o, line, b->len);
+        else            out_write(o, line, b->len);
+        out_putc(o, '\n');
+        ansi(o, A_RESET);
+        break;
+
+    case BK_CODE:
+        ansi(o, A_FENCE);
+        out_puts(o, "  ");
+        out_write(o, line + b->text, b->len - b->text);
+        out_putc(o, '\n');
+        ansi(o, A_RESET);
+        break;
+
+    case BK_BLANK:
+        ansi(o, A_RESET);   /* -j chunks start here in the plain style */
+        out_putc(o, '\n');
+        break;
+
+    case BK_HR:
+        render_hr(o);
+        break;
+
+    case BK_TABLE:
+        table_fit(o, d->cols + b->col, b->text);
+        table_topline(o);
+        render_row(o, d, b, 1);
+        table_hline(o);
+        break;
+
+    case BK_TABLE_ROW:
+        render_row(o, d, b, 0);
+        break;
+
+    case BK_TABLE_END:
+        table_botline(o);
+        break;
+
+    case BK_HEADING:
+        nest_prefix(o, d, b, PF_BLANK);
+        out_putc(o, '\n');
+        nest_prefix(o, d, b, PF_FIRST);
+        if (b->level == 1) {
+            ansi(o, A_H1);
+            render_text(o, d, b);
+            ansi(o, A_RESET); out_putc(o, '\n');
+            pfx_draw(o);
+            ansi(o, A_H1_RULE);
+            size_t rule = text_cols(d, b) + 2;
+            if (o->width > o->indent && rule > (size_t)(o->width - o->indent))
+                rule = (size_t)(o->width - o->indent);
+            out_repeat(o, "\xe2\x95\x90", 3, rule);   /* ═ */
+            ansi(o, A_RESET); out_putc(o, '\n');
+        } else if (b->level == 2) {
+            ansi(o, A_H2);
+            render_text(o, d, b);
+            ansi(o, A_RESET); out_putc(o, '\n');
+        } else {
+            ansi(o, A_H3);
+            render_text(o, d, b);
+            ansi(o, A_RESET); out_putc(o, '\n');
+        }
+        break;
+
+    default:   /* BK_PARA */
+        if (o->quote) ansi(o, A_QUOTE);
+        render_text(o, d, b);
+        if (o->quote) ansi(o, A_RESET);
+        out_putc(o, '\n');
+        break;
+    }
+}
+
+/* ── Reflow (--width) ───────────────────────────────────────────────────── */
+/*
+ * With a width set, paragraph text, in containers or not, is wrapped
+ * greedily at spaces instead of being printed line for line, and the
+ * lines of a paragraph are joined first.  Continuation lines repeat the
+ * container prefix.  The open output line lives in the Out, so a
+ * paragraph may continue across render batches until wrap_end() closes
+ * it.  A word wider than the line is split; inline code is not.
+ */
+
+static int reflows(const Out *o, int kind)
+{
+    return o->width > 0 && kind == BK_PARA;
+}
+
+/* Close the open reflowed line, if any. */
+static void wrap_end(Out *o)
+{
+    if (o->para < 0) return;
+    out_putc(o, '\n');
+    o->para = -1;
+}
+
+/* The paragraph's own style, under any inline spans */
+static void wrap_base(Out *o)
+{
+    if (o->quote) ansi(o, A_QUOTE);
+}
+
+/* Continue on a new output line, keeping the active styles. */
+static void wrap_break(Out *o, int state)
+{
+    if (o->quote || state != SPAN_NONE) ansi(o, A_RESET);
+    out_putc(o, '\n');
+    pfx_draw(o);
+    o->col = o->indent;
+    wrap_base(o);
+    span_on(o, state);
+}
+
+/* Emit text s[0..n), splitting it where it reaches the width. */
+static void wrap_text(Out *o, const char *s, size_t n, int state)
+{
+    while (n > 0) {
+        if (o->col >= o->width && o->col > o->indent) wrap_break(o, state);
+        int room = o->width - o->col;
+        if (room < 1) room = 1;
+
+        int    r0 = room;
+        size_t b  = utf8_prefix(s, n, &room);
+        if (b == 0) {   /* a wide character in the last column */
+            if (o->col > o->indent) { wrap_break(o, state); continue; }
+            int w;
+            b = utf8_char(s, n, &w);
+            room -= w;
+        }
+        out_write(o, s, b);
+        o->col += r0 - room;
+        s += b;
+        n -= b;
+    }
+}
+
+/* Switch to inline span state `state` */
+static void span_set(Out *o, int *shown, int state)
+{
+    span_move(o, *shown, state);
+    *shown = state;
+}
+
+/* Lay out the spans of one line word by word from the current column. */
+static void wrap_spans(Out *o, const char *line, const Span *sp, size_t n)
+{
+    int    state = SPAN_NONE;   /* as of the source position */
+    int    shown = SPAN_NONE;   /* as last emitted */
+    size_t k = 0, i = 0;        /* position: byte i of span k */
+
+    for (;;) {
+        /* skip spaces; styles met here take effect with the next word */
+        for (; k < n; k++, i = 0) {
+            if (sp[k].kind == SP_STYLE) {
+                state = sp[k].style;
+                continue;
+            }
+            if (sp[k].kind == SP_TEXT) {
+                const char *s = line + sp[k].off;
+                while (i < sp[k].len && s[i] == ' ') i++;
+                if (i == sp[k].len) continue;
+            }
+            break;
+        }
+        if (k == n) break;
+
+        /* measure the word: up to the next space, across spans */
+        size_t k2 = k, i2 = i;
+        int    w  = 0;
+        for (; k2 < n; k2++, i2 = 0) {
+            if (sp[k2].kind == SP_CODE) w += (int)sp[k2].width;
+            if (sp[k2].kind != SP_TEXT) continue;
+
+            const char *s   = line + sp[k2].off;
+            const char *gap = memchr(s + i2, ' ', sp[k2].len - i2);
+            size_t      e   = gap ? (size_t)(gap - s) : sp[k2].len;
+            w += text_width(s + i2, e - i2);
+            if (gap) { i2 = e; break; }
+        }
+
+        if (o->col > o->indent) {
+            if (o->col + 1 + w > o->width) wrap_break(o, shown);
+            else { out_putc(o, ' '); o->col++; }
+        }
+        if (state != shown) span_set(o, &shown, state);
+
+        /* emit it; the measuring loop only stops inside a text span */
+        for (; k < n && (k < k2 || i < i2); k++, i = 0) {
+            const char *s   = line + sp[k].off;
+            size_t      end = k < k2 ? sp[k].len : i2;
+
+            if (sp[k].kind == SP_TEXT) {
+                wrap_text(o, s + i, end - i, shown);
+            } else if (sp[k].kind == SP_CODE) {
+                ansi(o, A_CODE);
+                out_putc(o, ' ');
+                out_write(o, s, sp[k].len);
+                out_putc(o, ' ');
+                ansi(o, A_RESET);
+                wrap_base(o);
+                span_on(o, shown);
+                o->col += (int)sp[k].width;
+            } else {
+                span_set(o, &shown, state = sp[k].style);
+            }
+            if (k == k2) { i = i2; break; }
+        }
+    }
+    if (shown != SPAN_NONE) ansi(o, A_RESET);
+}
+
+static void reflow_block(Out *o, const Doc *d, const Block *b)
+{
+    if (o->para < 0 || !b->cont) {
+        wrap_end(o);
+        o->para = b->kind;
+        nest_prefix(o, d, b, PF_FIRST);
+        o->col = o->indent;
+    }
+    wrap_base(o);
+    wrap_spans(o, d->src + b->off, d->spans + b->span, b->nspans);
+    if (o->quote) ansi(o, A_RESET);
+}
+
+/* ── Markup output (--format=html|json) ─────────────────────────────────── */
+/*
+ * The same IR rendered as an HTML fragment or as a JSON syntax tree.
+ * Terminal lines are grouped back into the elements they came from: the
+ * lines of a paragraph, the rows of a table, and the quotes and list items
+ * around them, which are opened and closed as a block's containers differ
+ * from the last one's.  What is open at the end of one render batch stays
+ * open in the Out's Markup state for the next, so the output does not
+ * depend on where the batches were cut.  In HTML the first paragraph of a
+ * list item is its bare text, as in a tight list.
+ *
+ * JSON is an array with one object per element; a blockquote and each
+ * list item hold theirs in "blocks".  Inline content is a flat
+ * list of runs ("text" with "strong"/"em" flags, "code", "softbreak"),
+ * which is all the SP_STYLE state says; HTML nests <strong> and <em>
+ * instead, reopening an element where the two overlap.
+ */
+
+enum { MK_NONE, MK_PARA, MK_CODE, MK_ICODE, MK_TABLE };
+
+static void html_escape(Out *o, const char *s, size_t n)
+{
+    size_t i = 0, from = 0;
+
+    for (; i < n; i++) {
+        const char *e;
+        switch (s[i]) {
+        case '&': e = "&amp;";  break;
+        case '<': e = "&lt;";   break;
+        case '>': e = "&gt;";   break;
+        case '"': e = "&quot;"; break;
+        default:  continue;
+        }
+        out_write(o, s + from, i - from);
+        out_puts(o, e);
+        from = i + 1;
+    }
+    out_write(o, s + from, n - from);
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence at s[0..n), or 0 with *bad set
+ * to the length of its longest ill-formed prefix (at least 1), so that an
+ * overlong, surrogate, out-of-range or truncated sequence is one error.
+ */
+static size_t utf8_valid(const char *p, size_t n, size_t *bad)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    unsigned c = s[0], lo = 0x80, hi = 0xBF;
+    size_t   need, i;
+
+    if (c < 0x80) return 1;
+    if (c < 0xC2 || c > 0xF4) { *bad = 1; return 0; }
+    need = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+    if      (c == 0xE0) lo = 0xA0;
+    else if (c == 0xED) hi = 0x9F;
+    else if (c == 0xF0) lo = 0x90;
+    else if (c == 0xF4) hi = 0x8F;
+    for (i = 1; i <= need; i++, lo = 0x80, hi = 0xBF)
+        if (i >= n || s[i] < lo || s[i] > hi) { *bad = i; return 0; }
+    return i;
+}
+
+/* JSON string body: invalid UTF-8 becomes U+FFFD so the output parses */
+static void json_escape(Out *o, const char *s, size_t n)
+{
+    size_t i = 0, from = 0;
+
+    while (i < n) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x80) {
+            size_t bad, len = utf8_valid(s + i, n - i, &bad);
+            if (len) { i += len; continue; }
+            out_write(o, s + from, i - from);
+            out_puts(o, "\\ufffd");
+            from = i += bad;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') { i++; continue; }
+        out_write(o, s + from, i - from);
+        if (c == '"' || c == '\\') {
+            out_putc(o, '\\');
+            out_putc(o, (char)c);
+        } else {
+            char u[8];
+            snprintf(u, sizeof u, "\\u%04x", c);
+            out_puts(o, u);
+        }
+        from = ++i;
+    }
+    out_write(o, s + from, n - from);
+}
+
+/* JSON: start element number n[depth] of its array */
+static void json_sep(Out *o, int depth)
+{
+    if (depth == 0) out_puts(o, o->mk.n[0] ? ",\n" : "[\n");
+    else if (o->mk.n[depth]) out_putc(o, ',');
+    o->mk.n[depth]++;
+    for (int k = depth + 1; k < MK_DEPTH; k++) o->mk.n[k] = 0;
+}
+
+static void json_run_end(Out *o)
+{
+    if (!o->mk.run) return;
+    out_putc(o, '"');
+    if (o->mk.runstyle & SPAN_BOLD)   out_puts(o, ",\"strong\":true");
+    if (o->mk.runstyle & SPAN_ITALIC) out_puts(o, ",\"em\":true");
+    out_putc(o, '}');
+    o->mk.run = 0;
+}
+
+static void html_tag(Out *o, int bit, int open)
+{
+    out_puts(o, open ? "<" : "</");
+    out_puts(o, bit == SPAN_BOLD ? "strong>" : "em>");
+}
+
+/* Switch the open inline elements to SPAN_* state `to` */
+static void mk_style(Out *o, int to)
+{
+    int cur = o->mk.style;
+
+    if (o->format == MDCAT_HTML) {
+        while (cur & ~to) {   /* close from the inside out */
+            int in = cur == SPAN_BI ? o->mk.inner : cur;
+            html_tag(o, in, 0);
+            cur &= ~in;
+        }
+        for (int bit = SPAN_BOLD; bit <= SPAN_ITALIC; bit <<= 1)
+            if ((to & bit) && !(cur & bit)) {
+                html_tag(o, bit, 1);
+                o->mk.inner = bit;
+                cur |= bit;
+            }
+    }
+    o->mk.style = to;
+}
+
+/* Close the inline content of an element */
+static void mk_inline_end(Out *o)
+{
+    mk_style(o, SPAN_NONE);
+    json_run_end(o);
+}
+
+/* Inline spans of one line; JSON puts them at nesting `depth` */
+static void mk_spans(Out *o, const char *line, const Span *sp, size_t n, int depth)
+{
+    int json = o->format == MDCAT_JSON;
+
+    for (size_t k = 0; k < n; k++) {
+        const char *s = line + sp[k].off;
+
+        if (sp[k].kind == SP_STYLE) {
+            mk_style(o, sp[k].style);
+        } else if (sp[k].kind == SP_CODE) {
+            if (json) {
+                json_run_end(o);
+                json_sep(o, depth);
+                out_puts(o, "{\"type\":\"code\",\"text\":\"");
+                json_escape(o, s, sp[k].len);
+                out_puts(o, "\"}");
+            } else {
+                out_puts(o, "<code>");
+                html_escape(o, s, sp[k].len);
+                out_puts(o, "</code>");
+            }
+        } else if (sp[k].len) {   /* SP_TEXT */
+            if (!json) { html_escape(o, s, sp[k].len); continue; }
+            if (o->mk.run && o->mk.runstyle != o->mk.style) json_run_end(o);
+            if (!o->mk.run) {
+                json_sep(o, depth);
+                out_puts(o, "{\"type\":\"text\",\"text\":\"");
+                o->mk.run      = 1;
+                o->mk.runstyle = o->mk.style;
+            }
+            json_escape(o, s, sp[k].len);
+        }
+    }
+}
+
+/* A line break inside a paragraph */
+static void mk_softbreak(Out *o, int depth)
+{
+    if (o->format == MDCAT_HTML) {
+        out_putc(o, '\n');
+        return;
+    }
+    json_run_end(o);
+    json_sep(o, depth);
+    out_puts(o, "{\"type\":\"softbreak\"}");
+}
+
+/* Close the open leaf element, if any */
+static void mk_close(Out *o)
+{
+    int html = o->format == MDCAT_HTML;
+
+    switch (o->mk.open) {
+    case MK_PARA:
+        mk_inline_end(o);
+        if (!html)            out_puts(o, "]}");
+        else if (o->mk.bare)  o->mk.owe = 1;
+        else                  out_puts(o, "</p>\n");
+        break;
+    case MK_CODE:
+    case MK_ICODE: out_puts(o, html ? "</code></pre>\n" : "]}"); break;
+    case MK_TABLE: out_puts(o, html ? "</tbody>\n</table>\n" : "]}"); break;
+    }
+    o->mk.open   = MK_NONE;
+    o->mk.bare   = 0;
+    o->mk.blanks = 0;
+}
+
+/* HTML: the '\n' owed after the bare text of a list item */
+static void mk_owed(Out *o)
+{
+    if (o->mk.owe) out_putc(o, '\n');
+    o->mk.owe   = 0;
+    o->mk.first = 0;
+}
+
+static void mk_open(Out *o, int kind, const char *html, const char *json)
+{
+    mk_close(o);
+    if (o->format == MDCAT_JSON) {
+        json_sep(o, o->mk.base);
+        out_puts(o, json);
+    } else {
+        mk_owed(o);
+        out_puts(o, html);
+    }
+    o->mk.first = 0;
+    o->mk.open  = kind;
+}
+
+/* Close the innermost container; a list stays open if !list. */
+static void mk_level_close(Out *o, int list)
+{
+    int html = o->format == MDCAT_HTML;
+    int kind = o->mk.lvl[--o->mk.nlvl].kind;
+
+    if (kind == NS_QUOTE) {
+        out_puts(o, html ? "</blockquote>\n" : "]}");
+        o->mk.base -= 1;
+    } else {
+        out_puts(o, html ? "</li>\n" : "]}");
+        if (list) out_puts(o, !html ? "]}" : kind == NS_BULLET ? "</ul>\n" : "</ol>\n");
+        o->mk.base -= 2;
+    }
+    o->mk.owe = o->mk.first = 0;
+}
+
+/* Open container t; only its item if its list is open already. */
+static void mk_level_open(Out *o, const Doc *d, const Nest *t, int list)
+{
+    int         html = o->format == MDCAT_HTML;
+    const char *num  = d->src + t->mark;
+
+    if (html) mk_owed(o);
+    if (t->kind == NS_QUOTE) {
+        if (html) out_puts(o, "<blockquote>\n");
+        else      { json_sep(o, o->mk.base); out_puts(o, "{\"type\":\"blockquote\",\"blocks\":["); }
+        o->mk.base += 1;
+    } else {
+        if (list && html && t->kind == NS_BULLET) {
+            out_puts(o, "<ul>\n");
+        } else if (list && html) {
+            out_puts(o, "<ol");
+            if (t->marklen != 1 || num[0] != '1') {   /* list number other than 1 */
+                out_puts(o, " start=\"");
+                out_write(o, num, t->marklen);
+                out_putc(o, '"');
+            }
+            out_puts(o, ">\n");
+        } else if (list) {
+            json_sep(o, o->mk.base);
+            out_puts(o, t->kind == NS_BULLET ? "{\"type\":\"list\",\"ordered\":false,\"items\":["
+                                             : "{\"type\":\"list\",\"ordered\":true,\"items\":[");
+        }
+        if (html) {
+            out_puts(o, "<li>");
+        } else {
+            json_sep(o, o->mk.base + 1);
+            out_putc(o, '{');
+            if (t->kind == NS_ORDERED) {
+                size_t z = 0;   /* a JSON number has no leading zeros */
+                while (z + 1 < t->marklen && num[z] == '0') z++;
+                out_puts(o, "\"number\":");
+                out_write(o, num + z, t->marklen - z);
+                out_putc(o, ',');
+            }
+            out_puts(o, "\"blocks\":[");
+        }
+        o->mk.base += 2;
+        o->mk.first = 1;
+    }
+    o->mk.lvl[o->mk.nlvl].id   = t->id;
+    o->mk.lvl[o->mk.nlvl].kind = t->kind;
+    o->mk.nlvl++;
+}
+
+/*
+ * Close the open leaf and move to the containers of b: close those it is
+ * not in, innermost first, and open the new ones.  A new item after one
+ * of the same kind continues its list.
+ */
+static void mk_sync(Out *o, const Doc *d, const Block *b)
+{
+    const Nest *path[NEST_MAX];
+    int         n = nest_path(d, b, path), m = 0;
+
+    mk_close(o);
+    while (m < n && m < o->mk.nlvl && o->mk.lvl[m].id == path[m]->id) m++;
+    int keep = m < n && m < o->mk.nlvl && path[m]->kind != NS_QUOTE
+            && o->mk.lvl[m].kind == path[m]->kind;
+
+    while (o->mk.nlvl > m + keep) mk_level_close(o, 1);
+    if (keep) mk_level_close(o, 0);
+    for (int i = m; i < n; i++) mk_level_open(o, d, path[i], i > m || !keep);
+}
+
+/* True if b is in the containers that are open */
+static int mk_same(const Out *o, const Doc *d, const Block *b)
+{
+    int k = o->mk.nlvl;
+
+    for (uint32_t t = b->nest; t; t = d->nest[t - 1].parent)
+        if (--k < 0 || o->mk.lvl[k].id != d->nest[t - 1].id) return 0;
+    return k == 0;
+}
+
+static const char *const align_name[] = {
+    [ALIGN_LEFT] = "left", [ALIGN_CENTER] = "center", [ALIGN_RIGHT] = "right"
+};
+
+/* A table row: the cells of `b` as <th> or <td>, or JSON arrays at `depth` */
+static void mk_row(Out *o, const Doc *d, const Block *b, int depth)
+{
+    const char   *line = d->src + b->off;
+    const Span   *sp   = d->spans + b->span;
+    const Span   *end  = sp + b->nspans;
+    const Column *cols = d->cols + b->col;
+    int           html = o->format == MDCAT_HTML;
+    const char   *cell = b->kind == BK_TABLE ? "th" : "td";
+
+    out_puts(o, html ? "<tr>" : "[");
+    for (uint32_t c = 0; c < b->text; c++) {
+        const Span *text = ++sp;   /* past the SP_CELL */
+        while (sp < end && sp->kind != SP_CELL) sp++;
+
+        if (html) {
+            out_putc(o, '<');
+            out_puts(o, cell);
+            if (cols[c].align != ALIGN_LEFT) {
+                out_puts(o, " style=\"text-align: ");
+                out_puts(o, align_name[cols[c].align]);
+                out_putc(o, '"');
+            }
+            out_putc(o, '>');
+        } else {
+            json_sep(o, depth);
+            out_putc(o, '[');
+        }
+        mk_spans(o, line, text, (size_t)(sp - text), depth + 1);
+        mk_inline_end(o);
+        if (html) { out_puts(o, "</"); out_puts(o, cell); out_putc(o, '>'); }
+        else      out_putc(o, ']');
+    }
+    out_puts(o, html ? "</tr>\n" : "]");
+}
+
+static void mk_block(Out *o, const Doc *d, const Block *b)
+{
+    const char *line = d->src + b->off;
+    const Span *sp   = d->spans + b->span;
+    int         html = o->format == MDCAT_HTML;
+    int         base = o->mk.base;
+
+    switch (b->kind) {   /* blocks that go on with the open element */
+    case BK_PARA:
+        if (!b->cont || o->mk.open != MK_PARA) break;
+        mk_softbreak(o, base + 1);
+        mk_spans(o, line, sp, b->nspans, base + 1);
+        return;
+    case BK_BLANK:
+        if (o->mk.open != MK_ICODE || !mk_same(o, d, b)) break;
+        o->mk.blanks++;   /* in the code if more of it follows */
+        return;
+    case BK_CODE:
+        if (o->mk.open != MK_ICODE || !mk_same(o, d, b)) break;
+        for (; o->mk.blanks; o->mk.blanks--) {
+            if (html) out_putc(o, '\n');
+            else      { json_sep(o, base + 1); out_puts(o, "\"\""); }
+        }
+        goto code_line;
+    case BK_FENCE_LINE:
+    case BK_FENCE_CLOSE:
+    case BK_TABLE_ROW:
+    case BK_TABLE_END:
+        goto leaf;
+    }
+    mk_sync(o, d, b);
+    base = o->mk.base;
+
+leaf:
+    switch (b->kind) {
+    case BK_PARA:
+        if (html && o->mk.first) {   /* bare text of a list item */
+            mk_open(o, MK_PARA, "", NULL);
+            o->mk.bare = 1;
+        } else {
+            mk_open(o, MK_PARA, "<p>", "{\"type\":\"paragraph\",\"content\":[");
+        }
+        mk_spans(o, line, sp, b->nspans, base + 1);
+        break;
+
+    case BK_CODE:
+        mk_open(o, MK_ICODE, "<pre><code>", "{\"type\":\"code\",\"info\":\"\",\"lines\":[");
+    code_line:
+        line += b->text;
+        if (html) {
+            html_escape(o, line, b->len - b->text);
+            out_putc(o, '\n');
+        } else {
+            json_sep(o, base + 1);
+            out_putc(o, '"');
+            json_escape(o, line, b->len - b->text);
+            out_putc(o, '"');
+        }
+        break;
+
+    case BK_HEADING: {
+        char num[4];
+        snprintf(num, sizeof num, "%d", b->level > 6 ? 6 : b->level);
+        if (html) {
+            mk_owed(o);
+            out_puts(o, "<h"); out_puts(o, num); out_putc(o, '>');
+        } else {
+            json_sep(o, base);
+            out_puts(o, "{\"type\":\"heading\",\"level\":");
+            out_puts(o, num);
+            out_puts(o, ",\"content\":[");
+        }
+        mk_spans(o, line, sp, b->nspans, base + 1);
+        mk_inline_end(o);
+        if (html) { out_puts(o, "</h"); out_puts(o, num); out_puts(o, ">\n"); }
+        else      out_puts(o, "]}");
+        break;
+    }
+
+    case BK_HR:
+        if (html) {
+            mk_owed(o);
+            out_puts(o, "<hr>\n");
+        } else {
+            json_sep(o, base);
+            out_puts(o, "{\"type\":\"hr\"}");
+        }
+        break;
+
+    case BK_FENCE_OPEN: {
+        const char *info = line + 3, *end = line + b->len;
+        while (info < end && *info == ' ') info++;
+        const char *e = info;
+        while (e < end && *e != ' ') e++;
+
+        mk_open(o, MK_CODE, "<pre><code", "{\"type\":\"code\",\"info\":\"");
+        if (html && e > info) {
+            out_puts(o, " class=\"language-");
+            html_escape(o, info, (size_t)(e - info));
+            out_putc(o, '"');
+        }
+        if (html) out_putc(o, '>');
+        else      { json_escape(o, info, (size_t)(e - info)); out_puts(o, "\",\"lines\":["); }
+        break;
+    }
+
+    case BK_FENCE_LINE:
+        if (html) {
+            html_escape(o, line, b->len);
+            out_putc(o, '\n');
+        } else {
+            json_sep(o, base + 1);
+            out_putc(o, '"');
+            json_escape(o, line, b->len);
+            out_putc(o, '"');
+        }
+        break;
+
+    case BK_FENCE_CLOSE:
+    case BK_TABLE_END:
+        mk_close(o);
+        break;
+
+    case BK_TABLE: {
+        const Column *cols = d->cols + b->col;
+        if (html) {
+            mk_open(o, MK_TABLE, "<table>\n<thead>\n", NULL);
+            mk_row(o, d, b, base);
+            out_puts(o, "</thead>\n<tbody>\n");
+            break;
+        }
+        mk_open(o, MK_TABLE, NULL, "{\"type\":\"table\",\"align\":[");
+        for (uint32_t c = 0; c < b->text; c++) {
+            if (c) out_putc(o, ',');
+            out_putc(o, '"');
+            out_puts(o, align_name[cols[c].align]);
+            out_putc(o, '"');
+        }
+        out_puts(o, "],\"header\":");
+        mk_row(o, d, b, base + 2);
+        out_puts(o, ",\"rows\":[");
+        break;
+    }
+
+    case BK_TABLE_ROW:
+        if (!html) json_sep(o, base + 1);
+        mk_row(o, d, b, base + 2);
+        break;
+    }
+}
+
+/* End of a document in a markup format */
+static void mk_end(Out *o)
+{
+    mk_close(o);
+    while (o->mk.nlvl) mk_level_close(o, 1);
+    if (o->format == MDCAT_JSON) out_puts(o, o->mk.n[0] ? "\n]\n" : "[]\n");
+    memset(&o->mk, 0, sizeof o->mk);
+}
+
+/* Render every block in the IR. */
+#if MDCAT_STATS
+/* Count block `b`, and charge the time since `*t` to its stage.  Text
+ * counts as its innermost container's. */
+static void stat_block(Out *o, const Doc *d, const Block *b, uint64_t *t)
+{
+    static const unsigned char kinds[] = {
+        [BK_BLANK]      = SL_BLANK,  [BK_PARA]       = SL_PARA,
+        [BK_HEADING]    = SL_HEADING, [BK_HR]        = SL_HR,
+        [BK_FENCE_OPEN] = SL_FENCE,  [BK_FENCE_LINE] = SL_FENCE,
+        [BK_FENCE_CLOSE] = SL_FENCE, [BK_TABLE]      = SL_TABLE,
+        [BK_TABLE_ROW]  = SL_TABLE,  [BK_TABLE_END]  = SL_TABLE,
+        [BK_CODE]       = SL_FENCE,
+    };
+    Stats   *s   = o->stats;
+    uint64_t now = clock_ns();
+    uint64_t dt  = now - *t - (s->ns[ST_WRITE] - s->lap_write);
+    int      sl  = kinds[b->kind];
+
+    if (b->kind == BK_PARA && b->nest)
+        sl = d->nest[b->nest - 1].kind == NS_QUOTE ? SL_QUOTE : SL_LIST;
+
+    if (b->kind == BK_TABLE || b->kind == BK_TABLE_ROW) {
+        s->rows++;
+        s->cells += b->text;
+    }
+    if (b->kind == BK_TABLE)
+        s->lines[SL_TABLE] += 2;   /* and its separator row */
+    else if (b->kind != BK_TABLE_END && !(b->kind == BK_FENCE_CLOSE && b->level))
+        s->lines[sl]++;
+    s->ns[sl == SL_TABLE ? ST_TABLE : ST_TEXT] += dt;
+    s->lap_write = s->ns[ST_WRITE];
+    *t = now;
+}
+#endif
+
+static void render_doc(Out *o, const Doc *d)
+{
+    if (o->also) render_doc(o->also, d);
+    if (o->format != MDCAT_TERMINAL) {
+        for (size_t i = 0; i < d->nblocks; i++) mk_block(o, d, &d->blocks[i]);
+        return;
+    }
+#if MDCAT_STATS
+    uint64_t t = 0;
+    if (o->stats) {
+        t = clock_ns();
+        o->stats->lap_write = o->stats->ns[ST_WRITE];
+    }
+#endif
+    for (size_t i = 0; i < d->nblocks; i++) {
+        const Block *b = &d->blocks[i];
+        if (reflows(o, b->kind)) {
+            reflow_block(o, d, b);
+        } else {
+            wrap_end(o);
+            render_block(o, d, b);
+            out_block_end(o);
+        }
+#if MDCAT_STATS
+        if (o->stats) stat_block(o, d, b, &t);
+#endif
+    }
+}
+
+/* End of a document: close whatever is open, in every output. */
+static void render_end(Out *o)
+{
+    for (; o; o = o->also) {
+        if (o->format != MDCAT_TERMINAL) mk_end(o);
+        wrap_end(o);
+        sgr_end(o);
+    }
+}
+
+/* ── Driver ──────────────────────────────────────────────────────────────── */
+
+#ifndef MDCAT_LIB
+
+/* Render the IR whenever this many blocks are ready */
+#define BATCH_BLOCKS 4096
+
+/*
+ * Render [buf, buf+size) as a document, or as the rest of one whose fenced
+ * code is still open when `in_fence` is set (--lines).
+ */
+static void render_part(Out *o, const mdcat_options *opt,
+                        const char *buf, size_t size, int in_fence)
+{
+    const char *pos = buf;
+    const char *end = buf + size;
+    const char *line;
+    size_t      len;
+    Doc         doc = { 0 };
+    Parser      p   = { 0 };
+
+    STAT_VAR(t);
+
+    doc.src    = buf;
+    p.doc      = &doc;
+    p.stream   = opt->table_stream;
+    p.in_fence = in_fence;
+    STAT_ADD(o, bytes_in, size);
+    STAT_CLOCK(o, t);
+
+    while (next_line(&pos, end, &line, &len)) {
+        if (len > IR_LINE_MAX) { pos = line + IR_LINE_MAX; len = IR_LINE_MAX; }
+        parse_line(&p, line, len);
+        if (doc.nblocks >= BATCH_BLOCKS && parser_idle(&p)) {
+            STAT_LAP(o, ST_PARSE, t);
+            render_doc(o, &doc);
+            parser_reset(&p);
+            STAT_CLOCK(o, t);
+        }
+    }
+    parse_finish(&p);
+    STAT_LAP(o, ST_PARSE, t);
+    render_doc(o, &doc);
+    render_end(o);
+    doc_free(&doc);
+}
+
+static void render_file(Out *o, const mdcat_options *opt,
+                        const char *buf, size_t size)
+{
+    render_part(o, opt, buf, size, 0);
+}
+
+#endif /* !MDCAT_LIB */
+
+/* ── Incremental input ───────────────────────────────────────────────────── */
+/*
+ * A Feed renders input that arrives in pieces (follow mode, the library).
+ * It pushes each complete line into one long-lived Parser, so fence
+ * state, the table lookahead and a table being sized all carry over from
+ * one read to the next.  Whenever the parser is idle the IR is rendered
+ * and the consumed bytes are dropped.  Only the bytes the IR may still
+ * refer to are copied (the caller's buffer is parsed in place when nothing
+ * is held back): memory holds only an unfinished block and the partial last
+ * line, never the whole input.
+ */
+
+typedef struct {
+    Doc    doc;
+    Parser p;
+    char  *buf;      /* Doc.src */
+    size_t len, cap;
+    size_t scan;     /* first byte not yet parsed */
+} Feed;
+
+static void feed_init(Feed *f, const mdcat_options *opt)
+{
+    memset(f, 0, sizeof *f);
+    f->p.doc    = &f->doc;
+    f->p.stream = opt->table_stream;
+}
+
+static void feed_free(Feed *f)
+{
+    doc_free(&f->doc);
+    free(f->buf);
+}
+
+/* Render the IR if it is complete, and drop the bytes behind it. */
+static void feed_flush(Feed *f, Out *o)
+{
+    if (!parser_idle(&f->p)) return;
+    render_doc(o, &f->doc);
+    parser_reset(&f->p);
+    if (f->len > f->scan) memmove(f->buf, f->buf + f->scan, f->len - f->scan);
+    f->len -= f->scan;
+    f->scan = 0;
+}
+
+/* Parse the complete lines in [pos, end); returns where the partial one starts. */
+static const char *feed_lines(Parser *p, const char *pos, const char *end)
+{
+    const char *nl;
+    while ((nl = memchr(pos, '\n', (size_t)(end - pos)))) {
+        size_t len = (size_t)(nl - pos);
+        if (len > IR_LINE_MAX) {
+            parse_line(p, pos, IR_LINE_MAX);
+            pos += IR_LINE_MAX;
+            continue;
+        }
+        parse_line(p, pos, len);
+        pos = nl + 1;
+    }
+    return pos;
+}
+
+/* Keep a copy of `n` bytes after those held already. */
+static void feed_keep(Feed *f, const char *data, size_t n)
+{
+    if (f->cap - f->len < n) {
+        while (f->cap - f->len < n) f->cap = f->cap ? f->cap * 2 : READ_BLOCK;
+        f->buf = xrealloc(f->buf, f->cap);
+    }
+    if (n) memcpy(f->buf + f->len, data, n);
+    f->len    += n;
+    f->doc.src = f->buf;
+}
+
+static void feed(Feed *f, Out *o, const char *data, size_t n)
+{
+    STAT_VAR(t);
+
+    if (n == 0) return;   /* data may be NULL */
+    STAT_ADD(o, bytes_in, n);
+    STAT_CLOCK(o, t);
+    if (f->len == 0) {
+        /* Nothing held back: parse the caller's bytes in place.  If that
+         * ends every block, render and keep only the partial last line;
+         * otherwise keep the whole chunk, so that the IR's offsets into
+         * it stay valid in the copy. */
+        f->doc.src = data;
+        size_t done = (size_t)(feed_lines(&f->p, data, data + n) - data);
+        STAT_LAP(o, ST_PARSE, t);
+        if (parser_idle(&f->p)) {
+            render_doc(o, &f->doc);
+            parser_reset(&f->p);
+            data += done;
+            n    -= done;
+            done  = 0;
+        }
+        feed_keep(f, data, n);
+        f->scan = done;
+        return;
+    }
+    feed_keep(f, data, n);
+    f->scan = (size_t)(feed_lines(&f->p, f->buf + f->scan, f->buf + f->len) - f->buf);
+    STAT_LAP(o, ST_PARSE, t);
+    feed_flush(f, o);
+}
+
+/* End of input: the unterminated last line, if any, is a line too. */
+static void feed_finish(Feed *f, Out *o)
+{
+    if (f->len > f->scan) parse_line(&f->p, f->buf + f->scan, f->len - f->scan);
+    f->scan = f->len;
+    parse_finish(&f->p);
+    feed_flush(f, o);
+    render_end(o);
+}
+
+/* Forget all state, e.g. when a followed file was truncated. */
+static void feed_reset(Feed *f)
+{
+    long stream = f->p.stream;
+
+    memset(&f->p, 0, sizeof f->p);
+    f->p.doc       = &f->doc;
+    f->p.stream    = stream;
+    f->doc.nblocks = f->doc.nspans = f->doc.ncols = 0;
+    f->doc.nnest   = f->doc.cur = f->doc.fresh = 0;
+    f->len = f->scan = 0;
+}
+
+/* ── Library API (mdcat.h) ───────────────────────────────────────────────── */
+/*
+ * A context is one Feed draining into the caller's write callback.  It
+ * owns every piece of state, so contexts on different threads share
+ * nothing but the read-only scanner choice.  Buffers are allocated in
+ * mdcat_new() and otherwise only grow to the largest unfinished block
+ * seen, after which feeding does not allocate.
+ */
+
+struct mdcat_ctx {
+    Out  out;
+    Feed feed;
+};
+
+static const mdcat_options default_options = { 1, -1, 0, MDCAT_TERMINAL };
+
+mdcat_ctx *mdcat_new(const mdcat_options *opt, mdcat_write_fn write, void *user)
+{
+    mdcat_ctx *ctx = xrealloc(NULL, sizeof *ctx);
+
+    if (!opt) opt = &default_options;
+    scan_init();
+    out_init(&ctx->out, -1, opt);
+    ctx->out.write = write;
+    ctx->out.user  = user;
+    feed_init(&ctx->feed, opt);
+    return ctx;
+}
+
+int mdcat_feed(mdcat_ctx *ctx, const char *buf, size_t len)
+{
+    if (!ctx->out.err) {
+        feed(&ctx->feed, &ctx->out, buf, len);
+        out_flush(&ctx->out);
+    }
+    return ctx->out.err;
+}
+
+int mdcat_finish(mdcat_ctx *ctx)
+{
+    int err;
+
+    if (!ctx->out.err) {
+        feed_finish(&ctx->feed, &ctx->out);
+        out_flush(&ctx->out);
+    }
+    err = ctx->out.err;
+    feed_reset(&ctx->feed);
+    out_reset(&ctx->out);   /* after an error, the document is still open */
+    ctx->out.len = 0;
+    ctx->out.err = 0;
+    return err;
+}
+
+void mdcat_free(mdcat_ctx *ctx)
+{
+    if (!ctx) return;
+    feed_free(&ctx->feed);
+    out_free(&ctx->out);
+    free(ctx);
+}
+
+#ifndef MDCAT_LIB   /* the rest is the command-line tool */
+
+static mdcat_options g_opts   = { 1, -1, 0, MDCAT_TERMINAL };   /* color: off when not a TTY */
+static long          g_jobs   = 1;           /* -j N: render threads per document */
+static int           g_follow = 0;           /* -f: keep rendering appended input */
+static int           g_pager  = 0;           /* --pager: page through one input */
+static int           g_serve  = 0;           /* --serve: render framed documents */
+static const char   *g_socket;               /* --serve=PATH */
+static int           g_color  = -1;          /* --format=ansi|plain; -1: if a TTY */
+static const char   *g_also_html;            /* --also-html=FILE */
+static int           g_plain_fences;         /* --no-style-in-fences */
+static const char   *g_section;              /* --section=TEXT */
+static long          g_line_from, g_line_to; /* --lines=A-B; to 0: the end */
+static int           g_index;                /* --index: keep FILE.mdcat-index */
+static const char   *g_cache_dir;            /* --cache-dir=DIR */
+#if MDCAT_STATS
+static Stats         g_stats;
+static int           g_want_stats;           /* --stats */
+#endif
+static long long     g_cache_max = 64LL << 20;   /* --cache-size=MB, in bytes */
+
+/* ── Themes ──────────────────────────────────────────────────────────────── */
+/*
+ * --theme=FILE restyles roles of the colour theme, one per line:
+ *
+ *     # comment
+ *     h1     = bold underline cyan
+ *     code   = 215 on 236
+ *     marker = plain
+ *
+ * A style is any of bold, dim, italic and underline, a foreground colour
+ * (a name or a 256-colour index) and `on` a background colour.  Roles not
+ * named keep their default style.
+ */
+
+static const char *const theme_roles[A_NROLES] = {
+    [A_BOLD]       = "strong",
+    [A_ITALIC]     = "em",
+    [A_CODE]       = "code",
+    [A_FENCE_OPEN] = "fence-open",
+    [A_FENCE_LANG] = "fence-lang",
+    [A_FENCE]      = "fence",
+    [A_H1]         = "h1",
+    [A_H1_RULE]    = "h1-rule",
+    [A_H2]         = "h2",
+    [A_H3]         = "h3",
+    [A_QUOTE_BAR]  = "quote-bar",
+    [A_QUOTE]      = "quote",
+    [A_MARKER]     = "marker",
+    [A_BORDER]     = "border",
+    [A_TH]         = "table-header",
+    [A_HR]         = "hr",
+    [A_HL_KEYWORD] = "code-keyword",
+    [A_HL_STRING]  = "code-string",
+    [A_HL_NUMBER]  = "code-number",
+    [A_HL_COMMENT] = "code-comment",
+    [A_HL_META]    = "code-meta",
+    [A_HL_KEY]     = "code-key",
+    [A_HL_ADD]     = "code-added",
+    [A_HL_DEL]     = "code-removed",
+};
+
+static const char *const theme_colors[] = {
+    "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white",
+};
+
+/* Parse one colour word into its packed value (as S_FG), or 0 if invalid */
+static uint32_t theme_color_word(const char *w)
+{
+    for (unsigned i = 0; i < 8; i++)
+        if (strcmp(w, theme_colors[i]) == 0) return 30 + i;
+
+    char *e;
+    long  n = strtol(w, &e, 10);
+    return e != w && *e == '\0' && n >= 0 && n <= 255 ? 256 + (uint32_t)n : 0;
+}
+
+/* Parse the words of a style.  Returns 0 or -1 with `*bad` at the culprit. */
+static int theme_style(char *s, uint32_t *style, const char **bad)
+{
+    int bg = 0;
+
+    *style = 0;
+    for (char *w = strtok(s, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+        uint32_t c;
+        *bad = w;
+        if      (strcmp(w, "plain") == 0)     continue;
+        else if (strcmp(w, "bold") == 0)      *style |= S_BOLD;
+        else if (strcmp(w, "dim") == 0)       *style |= S_DIM;
+        else if (strcmp(w, "italic") == 0)    *style |= S_ITALIC;
+        else if (strcmp(w, "underline") == 0) *style |= S_UNDER;
+        else if (strcmp(w, "on") == 0 && !bg) { bg = 1; continue; }
+        else if ((c = theme_color_word(w)) && bg)
+            *style = (*style & ~S_BGMASK) | S_BG(c + (c < 256 ? 10 : 0));
+        else if (c)
+            *style = (*style & ~S_FGMASK) | S_FG(c);
+        else
+            return -1;
+        if (bg) bg = 2;
+    }
+    return bg == 1 ? -1 : 0;   /* `on` without a colour */
+}
+
+/* Load --theme=FILE into the colour theme; exits on errors. */
+static void theme_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char  line[512];
+    int   n = 0;
+
+    if (!fp) {
+        fprintf(stderr, "mdcat: cannot open theme '%s': %s\n", path,
+                strerror(errno));
+        exit(2);
+    }
+    while (fgets(line, sizeof line, fp)) {
+        char       *s = line + strspn(line, " \t");
+        char       *eq = strchr(s, '=');
+        const char *bad = "on";
+        uint32_t    style;
+        int         role;
+
+        n++;
+        if (*s == '#' || s[strspn(s, " \t\r\n")] == '\0') continue;
+        if (!eq) {
+            fprintf(stderr, "mdcat: %s:%d: expected 'role = style'\n", path, n);
+            exit(2);
+        }
+        *eq = '\0';
+        s[strcspn(s, " \t")] = '\0';
+        for (role = 1; role < A_NROLES; role++)
+            if (strcmp(s, theme_roles[role]) == 0) break;
+        if (role == A_NROLES) {
+            fprintf(stderr, "mdcat: %s:%d: unknown role '%s'\n", path, n, s);
+            exit(2);
+        }
+        if (theme_style(eq + 1, &style, &bad) < 0) {
+            fprintf(stderr, "mdcat: %s:%d: invalid style '%s'\n", path, n, bad);
+            exit(2);
+        }
+        theme_color[role] = style;
+    }
+    fclose(fp);
+}
+
+/* --no-style-in-fences: code blocks go out without escapes */
+static void theme_plain_fences(void)
+{
+    theme_color[A_FENCE_OPEN] = theme_color[A_FENCE_LANG] = theme_color[A_FENCE] = 0;
+    for (int r = A_HL_KEYWORD; r <= A_HL_DEL; r++) theme_color[r] = 0;
+}
+
+/* ── --stats report ──────────────────────────────────────────────────────── */
+
+#if MDCAT_STATS
+static void stats_add(Stats *to, const Stats *s)
+{
+    to->bytes_in  += s->bytes_in;
+    to->bytes_out += s->bytes_out;
+    to->sgr_bytes += s->sgr_bytes;
+    to->rows      += s->rows;
+    to->cells     += s->cells;
+    for (int i = 0; i < SL_NKINDS; i++)  to->lines[i] += s->lines[i];
+    for (int i = 0; i < ST_NSTAGES; i++) to->ns[i]    += s->ns[i];
+}
+
+static void stats_print(const Stats *s)
+{
+    static const char *const kinds[SL_NKINDS] = {
+        "blank", "paragraph", "heading", "quote", "list", "rule", "fence",
+        "table",
+    };
+    static const char *const stages[ST_NSTAGES] = {
+        "parse", "tables", "text", "write",
+    };
+
+    fprintf(stderr, "mdcat: %llu bytes in, %llu bytes out (%llu in escapes)\n",
+            (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+            (unsigned long long)s->sgr_bytes);
+    fputs("mdcat: lines:", stderr);
+    for (int i = 0; i < SL_NKINDS; i++)
+        fprintf(stderr, " %s %llu", kinds[i], (unsigned long long)s->lines[i]);
+    fprintf(stderr, "\nmdcat: tables: %llu rows, %llu cells\nmdcat: time:",
+            (unsigned long long)s->rows, (unsigned long long)s->cells);
+    for (int i = 0; i < ST_NSTAGES; i++)
+        fprintf(stderr, " %s %.3f ms", stages[i], (double)s->ns[i] / 1e6);
+    fputc('\n', stderr);
+}
+#endif
+
+/* ── Inputs ──────────────────────────────────────────────────────────────── */
+
+/* Open and map one input ("-" is stdin).  Returns 0 or an errno value. */
+static int load_path(const char *path, Input *in)
+{
+    int is_stdin = (strcmp(path, "-") == 0);
+    int fd       = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+
+    if (fd < 0) return errno;
+    int err = (input_open(in, fd) < 0) ? errno : 0;
+    if (!is_stdin) close(fd);
+    return err;
+}
+
+static void open_error(const char *path, int err)
+{
+    fprintf(stderr, "mdcat: cannot open '%s': %s\n",
+            strcmp(path, "-") == 0 ? "stdin" : path, strerror(err));
+}
+
+/* ── Parallel rendering (-j N) ───────────────────────────────────────────── */
+/*
+ * Work is split into tasks that workers render into memory Outs, while the
+ * calling thread writes the results strictly in task order.  Workers stay
+ * at most PAR_WINDOW tasks per thread ahead of the writer, so memory is
+ * bounded by the window, not by the amount of input.
+ *
+ * With one large document the tasks are chunks of it, cut at blank lines
+ * outside fenced code.  After such a line the parser is always back in its
+ * initial state: a blank line resolves the table lookahead and ends any
+ * table, and the pre-scan tracks ``` lines exactly as parse_block()
+ * toggles fences.  Each chunk can therefore be parsed and rendered on its
+ * own, and the output is byte-identical to the serial path.
+ *
+ * With several files each file is a task, so opening and reading the next
+ * files overlaps with rendering and writing the current one.
+ */
+
+#define PAR_CHUNK   (4 * 1024 * 1024)   /* target chunk size */
+#define PAR_WINDOW  2                   /* tasks in flight per worker */
+#define PAR_THREADS 64
+
+typedef struct Task {
+    const char *start;   /* a chunk of the document, or */
+    size_t      len;
+    const char *path;    /* a whole file */
+    Out         out;
+#if MDCAT_STATS
+    Stats       stats;
+#endif
+    int         err;     /* errno from opening `path` */
+    int         done;
+} Task;
+
+typedef struct {
+    Task           *tasks;
+    size_t          ntasks;
+    size_t          next;      /* next task to hand to a worker */
+    size_t          written;   /* tasks already written out */
+    size_t          window;
+    int             stop;      /* writer gave up: hand out no more tasks */
+    void          (*run)(Task *);
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} Pool;
+
+static void *pool_worker(void *arg)
+{
+    Pool *p = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->next < p->ntasks
+               && p->next >= p->written + p->window)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stop || p->next == p->ntasks) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        Task *t = &p->tasks[p->next++];
+        pthread_mutex_unlock(&p->lock);
+
+        out_init(&t->out, -1, &g_opts);
+#if MDCAT_STATS
+        if (g_want_stats) t->out.stats = &t->stats;
+#endif
+        p->run(t);
+
+        pthread_mutex_lock(&p->lock);
+        t->done = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/*
+ * Run `run` over tasks[0..n) on g_jobs threads and write their output to
+ * `o` in order.  Stops at the first task that reports an error and returns
+ * its index; returns n when all succeeded.
+ */
+static size_t pool_run(Out *o, Task *tasks, size_t n, void (*run)(Task *))
+{
+    Pool      p;
+    pthread_t tid[PAR_THREADS];
+    long      nthreads = g_jobs < PAR_THREADS ? g_jobs : PAR_THREADS;
+    long      started  = 0;
+    size_t    k;
+
+    p.tasks   = tasks;
+    p.ntasks  = n;
+    p.next    = 0;
+    p.written = 0;
+    p.window  = (size_t)nthreads * PAR_WINDOW;
+    p.stop    = 0;
+    p.run     = run;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    while (started < nthreads
+           && pthread_create(&tid[started], NULL, pool_worker, &p) == 0)
+        started++;
+    if (started == 0) p.window = n;   /* no threads: everything inline */
+
+    for (k = 0; k < n; k++) {
+        Task *t = &tasks[k];
+
+        if (started == 0 && !t->done) pool_worker(&p);
+
+        pthread_mutex_lock(&p.lock);
+        while (!t->done) pthread_cond_wait(&p.cond, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+
+        if (t->err) break;
+        out_write(o, t->out.buf, t->out.len);
+        out_free(&t->out);
+#if MDCAT_STATS
+        if (o->stats) stats_add(o->stats, &t->stats);
+#endif
+
+        pthread_mutex_lock(&p.lock);
+        p.written++;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+
+    for (long i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    for (size_t i = k; i < n; i++) out_free(&tasks[i].out);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    return k;
+}
+
+/*
+ * End of the chunk that starts at `start`: just after the first blank
+ * line outside fenced code once `target` bytes are behind, or `end`.  The
+ * line after it must not be able to continue a quote or list item, so it
+ * starts with neither a space nor a marker.
+ */
+static const char *chunk_end(const char *start, const char *end, size_t target)
+{
+    const char *pos = start;
+    const char *line;
+    size_t      len;
+    int         in_fence = 0;
+
+    while (next_line(&pos, end, &line, &len)) {
+        if (len >= 3 && memcmp(line, "```", 3) == 0) in_fence = !in_fence;
+        else if (len == 0 && !in_fence && (size_t)(pos - start) >= target
+                 && pos < end && !strchr(" \t\n>-*+0123456789", *pos))
+            break;
+    }
+    return pos;
+}
+
+/* Cut [buf, buf+size) into chunks of about PAR_CHUNK bytes.  Returns count. */
+static size_t split_chunks(const char *buf, size_t size, Task **out)
+{
+    const char *start = buf;
+    const char *end   = buf + size;
+    Task       *tasks = NULL;
+    size_t      n = 0, cap = 0;
+
+    do {
+        const char *stop = chunk_end(start, end, PAR_CHUNK);
+        if (n == cap) {
+            cap   = cap ? cap * 2 : 16;
+            tasks = xrealloc(tasks, cap * sizeof *tasks);
+        }
+        memset(&tasks[n], 0, sizeof *tasks);
+        tasks[n].start = start;
+        tasks[n].len   = (size_t)(stop - start);
+        n++;
+        start = stop;
+    } while (start < end);
+    *out = tasks;
+    return n;
+}
+
+static void run_chunk(Task *t)
+{
+    render_file(&t->out, &g_opts, t->start, t->len);
+}
+
+static void render_parallel(Out *o, const char *buf, size_t size)
+{
+    Task  *tasks;
+    size_t n = split_chunks(buf, size, &tasks);
+
+    if (n == 1) render_file(o, &g_opts, buf, size);
+    else        pool_run(o, tasks, n, run_chunk);
+    free(tasks);
+}
+
+static void run_file(Task *t)
+{
+    Input in;
+
+    t->err = load_path(t->path, &in);
+    if (t->err) return;
+    render_file(&t->out, &g_opts, in.data, in.len);
+    input_close(&in);
+}
+
+/* Render several files concurrently.  Returns 0, or 1 after an error. */
+static int render_files_parallel(Out *o, char **paths, size_t n)
+{
+    Task *tasks = xrealloc(NULL, n * sizeof *tasks);
+
+    memset(tasks, 0, n * sizeof *tasks);
+    for (size_t i = 0; i < n; i++) tasks[i].path = paths[i];
+
+    size_t k = pool_run(o, tasks, n, run_file);
+    if (k < n) open_error(tasks[k].path, tasks[k].err);
+    free(tasks);
+    return k < n;
+}
+
+/* ── Follow mode (-f) ────────────────────────────────────────────────────── */
+/*
+ * Like tail -f: render what the file holds, then whatever is appended, all
+ * through one Feed, so a fence or table split across writes renders as if
+ * it had been read in one go.  Changes are waited for with inotify or
+ * kqueue where available, otherwise by polling.  A truncated file is
+ * rendered again from the start; a deleted one ends the follow.  Pipes and
+ * other non-regular inputs are simply streamed until EOF.
+ */
+
+#define FOLLOW_POLL_MS 250
+
+/* Returns a descriptor that signals changes to the file, or -1 to poll. */
+static int watch_open(int fd, const char *path)
+{
+#if defined(HAVE_INOTIFY)
+    int w = inotify_init1(IN_CLOEXEC);
+    (void)fd;
+    if (w >= 0 && inotify_add_watch(w, path, IN_MODIFY | IN_ATTRIB) < 0) {
+        close(w);
+        w = -1;
+    }
+    return w;
+#elif defined(HAVE_KQUEUE)
+    struct kevent ev;
+    int w = kqueue();
+    (void)path;
+    EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE, 0, NULL);
+    if (w >= 0 && kevent(w, &ev, 1, NULL, 0, NULL) < 0) {
+        close(w);
+        w = -1;
+    }
+    return w;
+#else
+    (void)fd;
+    (void)path;
+    return -1;
+#endif
+}
+
+/* Block until the file may have changed, or for at most `ms` unless that
+ * is negative.  Events are only wake-ups. */
+static void watch_wait(int w, int ms)
+{
+#if defined(HAVE_INOTIFY)
+    char          ev[4096];
+    struct pollfd pfd = { w, POLLIN, 0 };
+    if (w >= 0 && poll(&pfd, 1, ms) >= 0) {
+        if (pfd.revents & POLLIN) {
+            ssize_t n = read(w, ev, sizeof ev);
+            (void)n;
+        }
+        return;
+    }
+#elif defined(HAVE_KQUEUE)
+    struct kevent   ev;
+    struct timespec to = { ms / 1000, ms % 1000 * 1000000L };
+    if (w >= 0 && kevent(w, NULL, 0, &ev, 1, ms < 0 ? NULL : &to) >= 0) return;
+#endif
+    if (ms < 0 || ms > FOLLOW_POLL_MS) ms = FOLLOW_POLL_MS;
+    struct timespec ts = { 0, ms * 1000000L };
+    (void)w;
+    nanosleep(&ts, NULL);
+}
+
+/* Follow one input ("-" is stdin).  Returns 0, or 1 after reporting an error. */
+static int follow_path(Out *o, const char *path)
+{
+    int is_stdin = (strcmp(path, "-") == 0);
+    int fd       = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        open_error(path, errno);
+        if (fd > STDIN_FILENO) close(fd);
+        return 1;
+    }
+
+    int    regular = S_ISREG(st.st_mode);
+    int    w       = regular ? watch_open(fd, path) : -1;
+    char  *buf     = xrealloc(NULL, READ_BLOCK);
+    off_t  pos     = 0;
+    int    rc      = 0;
+    Feed   f;
+
+    feed_init(&f, &g_opts);
+    for (;;) {
+        if (!regular && out_hold(o) > 0) {   /* a pipe: write what waits if it goes quiet */
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, out_hold(o)) == 0) out_flush(o);
+        }
+        ssize_t n = read(fd, buf, READ_BLOCK);
+        if (n > 0) {
+            feed(&f, o, buf, (size_t)n);
+            pos += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fprintf(stderr, "mdcat: cannot read '%s': %s\n",
+                    is_stdin ? "stdin" : path, strerror(errno));
+            rc = 1;
+            break;
+        }
+
+        int hold = out_hold(o);   /* coalesce appends to a terminal */
+        if (hold <= 0) {
+            out_flush(o);
+            hold = -1;
+        }
+        if (o->err || !regular) break;
+        if (fstat(fd, &st) < 0 || st.st_nlink == 0) break;
+        if (st.st_size < pos) {
+            wrap_end(o);
+            feed_reset(&f);
+            pos = lseek(fd, 0, SEEK_SET);
+            continue;
+        }
+        watch_wait(w, hold);
+    }
+    feed_finish(&f, o);
+    feed_free(&f);
+    free(buf);
+    if (w >= 0) close(w);
+    if (!is_stdin) close(fd);
+    return rc;
+}
+
+/* ── Pager (--pager) ─────────────────────────────────────────────────────── */
+/*
+ * --pager shows one input a screen at a time without rendering all of it
+ * first.  The input is cut lazily into chunks of about PG_CHUNK bytes at
+ * the restart points -j uses (see chunk_end()), and only the chunks under
+ * the screen are rendered, into memory; the PG_CACHE most recently used
+ * stay rendered.  Out.line_sgr makes every rendered line carry its own
+ * style, so any line can be drawn first, and the terminal clips long
+ * lines while autowrap is off.
+ */
+
+#define PG_CHUNK (64 * 1024)
+#define PG_CACHE 8
+
+typedef struct {
+    size_t        chunk;    /* chunk rendered here, or SIZE_MAX */
+    char         *text;
+    size_t       *line;     /* line k is text[line[k] .. line[k + 1]) */
+    size_t        nlines;
+    unsigned long used;     /* LRU clock */
+} PgPage;
+
+typedef struct {
+    const char   *data;
+    size_t        size;
+    size_t       *cut;      /* chunk k is data[cut[k] .. cut[k + 1]) */
+    size_t        ncut, cutcap;
+    PgPage        page[PG_CACHE];
+    unsigned long clock;
+    size_t        top, row; /* first line on screen: chunk, line in it */
+    int           rows;
+} Pager;
+
+static volatile sig_atomic_t g_pg_winch, g_pg_quit;
+
+static void pg_signal(int sig)
+{
+    if (sig == SIGWINCH) g_pg_winch = 1;
+    else                 g_pg_quit  = 1;
+}
+
+/* True when chunk k exists, cutting the input up to it if need be */
+static int pg_have(Pager *p, size_t k)
+{
+    while (p->ncut < k + 2 && p->cut[p->ncut - 1] < p->size) {
+        if (p->ncut == p->cutcap) {
+            p->cutcap *= 2;
+            p->cut = xrealloc(p->cut, p->cutcap * sizeof *p->cut);
+        }
+        const char *start = p->data + p->cut[p->ncut - 1];
+        p->cut[p->ncut++] = (size_t)(chunk_end(start, p->data + p->size, PG_CHUNK)
+                                     - p->data);
+    }
+    return p->ncut >= k + 2;
+}
+
+/* Chunk k (which must exist) rendered */
+static PgPage *pg_page(Pager *p, size_t k)
+{
+    PgPage *pg = &p->page[0];
+
+    for (int i = 0; i < PG_CACHE; i++) {
+        if (p->page[i].chunk == k) { pg = &p->page[i]; goto hit; }
+        if (p->page[i].used < pg->used) pg = &p->page[i];
+    }
+
+    Out m;
+    out_init(&m, -1, &g_opts);
+    m.line_sgr = 1;
+    render_file(&m, &g_opts, p->data + p->cut[k], p->cut[k + 1] - p->cut[k]);
+
+    size_t n = 0;
+    for (const char *s = m.buf, *end = m.buf + m.len;
+         (s = memchr(s, '\n', (size_t)(end - s))); s++)
+        n++;
+    free(pg->text);
+    pg->text   = m.buf;
+    pg->line   = xrealloc(pg->line, (n + 2) * sizeof *pg->line);
+    pg->nlines = 0;
+    pg->line[0] = 0;
+    for (size_t i = 0; i < m.len; i++)
+        if (m.buf[i] == '\n') pg->line[++pg->nlines] = i + 1;
+    if (pg->line[pg->nlines] < m.len) pg->line[++pg->nlines] = m.len;
+    pg->chunk = k;
+hit:
+    pg->used = ++p->clock;
+    return pg;
+}
+
+/* Drop all rendered chunks, e.g. after the width changed */
+static void pg_flush(Pager *p)
+{
+    for (int i = 0; i < PG_CACHE; i++) p->page[i].chunk = SIZE_MAX;
+}
+
+/* Step (*k, *l) to the next line.  Returns 0 at the end of the input. */
+static int pg_next(Pager *p, size_t *k, size_t *l)
+{
+    if (!pg_have(p, *k)) return 0;   /* empty input */
+    if (*l + 1 < pg_page(p, *k)->nlines) { ++*l; return 1; }
+    for (size_t j = *k + 1; pg_have(p, j); j++)
+        if (pg_page(p, j)->nlines > 0) { *k = j; *l = 0; return 1; }
+    return 0;
+}
+
+/* Step (*k, *l) to the previous line.  Returns 0 at the start. */
+static int pg_prev(Pager *p, size_t *k, size_t *l)
+{
+    if (*l > 0) { --*l; return 1; }
+    for (size_t j = *k; j-- > 0; ) {
+        size_t n = pg_page(p, j)->nlines;
+        if (n > 0) { *k = j; *l = n - 1; return 1; }
+    }
+    return 0;
+}
+
+/* Scroll by n lines, no further than the last screen or the first line */
+static void pg_scroll(Pager *p, long n)
+{
+    for (; n < 0 && pg_prev(p, &p->top, &p->row); n++) {}
+    for (; n > 0; n--) {
+        size_t k = p->top, l = p->row;
+        int    r = 0;
+        while (r < p->rows - 1 && pg_next(p, &k, &l)) r++;
+        if (r < p->rows - 1 || !pg_next(p, &p->top, &p->row)) break;
+    }
+}
+
+static void pg_end(Pager *p)
+{
+    while (p->cut[p->ncut - 1] < p->size) pg_have(p, p->ncut - 1);
+    for (size_t j = p->ncut - 1; j-- > 0; ) {
+        size_t n = pg_page(p, j)->nlines;
+        if (n > 0) { p->top = j; p->row = n - 1; break; }
+    }
+    for (int r = 1; r < p->rows - 1 && pg_prev(p, &p->top, &p->row); r++) {}
+}
+
+static void pg_draw(Pager *p, Out *o, const char *name)
+{
+    size_t k = p->top, l = p->row;
+    int    more = pg_have(p, 0);
+    double pos  = 0;
+    char   status[16];
+
+    if (more) {
+        /* the top line's share of its chunk, taking lines as equally long */
+        PgPage *pg = pg_page(p, k);
+        pos = (double)p->cut[k] + (double)(p->cut[k + 1] - p->cut[k])
+                                  * (double)l / (double)(pg->nlines ? pg->nlines : 1);
+    }
+    out_bytes(o, "\033[H", 3);
+    for (int r = 0; r < p->rows - 1; r++) {
+        if (more) {
+            PgPage *pg = pg_page(p, k);
+            size_t  a = pg->line[l], b = pg->line[l + 1];
+            if (b > a && pg->text[b - 1] == '\n') b--;
+            out_bytes(o, pg->text + a, b - a);
+            more = pg_next(p, &k, &l);
+        }
+        out_bytes(o, "\033[0m\033[K\n", 8);
+    }
+    if (more)
+        snprintf(status, sizeof status, "%d%%",
+                 (int)(100.0 * pos / (double)p->size));
+    else
+        strcpy(status, "(END)");
+    out_puts(o, "\033[7m ");
+    out_puts(o, name);
+    out_puts(o, "  ");
+    out_puts(o, status);
+    out_puts(o, " \033[0m\033[K");
+    out_flush(o);
+}
+
+/* Screen rows, and the render width unless --width was given */
+static void pg_size(Pager *p, int auto_width)
+{
+    struct winsize ws;
+
+    p->rows = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) {
+        p->rows = ws.ws_row;
+        if (auto_width) g_opts.width = ws.ws_col;
+    }
+}
+
+/* Read one key; returns it, a PK_* code, or -1 when interrupted. */
+enum { PK_UP = 256, PK_DOWN, PK_PGUP, PK_PGDN, PK_HOME, PK_END };
+
+static int pg_key(int tty)
+{
+    unsigned char b[8];
+    ssize_t       n = read(tty, b, sizeof b);
+
+    if (n <= 0) return n < 0 && errno == EINTR ? -1 : 'q';
+    if (b[0] != 033 || n < 3 || (b[1] != '[' && b[1] != 'O')) return b[0];
+    switch (b[2]) {
+    case 'A': return PK_UP;
+    case 'B': return PK_DOWN;
+    case 'H': return PK_HOME;
+    case 'F': return PK_END;
+    case '1': return PK_HOME;
+    case '4': return PK_END;
+    case '5': return PK_PGUP;
+    case '6': return PK_PGDN;
+    }
+    return 0;
+}
+
+static int page_path(Out *o, const char *path, int auto_width)
+{
+    Input  in;
+    int    err = load_path(path, &in);
+    int    tty;
+    Pager  p;
+    struct termios saved, raw;
+    struct sigaction sa;
+
+    if (err) {
+        open_error(path, err);
+        return 1;
+    }
+    if ((tty = open("/dev/tty", O_RDONLY)) < 0 || tcgetattr(tty, &saved) < 0) {
+        fprintf(stderr, "mdcat: --pager needs a terminal: %s\n", strerror(errno));
+        input_close(&in);
+        return 1;
+    }
+
+    memset(&p, 0, sizeof p);
+    p.data   = in.data;
+    p.size   = in.len;
+    p.cutcap = 1024;
+    p.cut    = xrealloc(NULL, p.cutcap * sizeof *p.cut);
+    p.cut[0] = 0;
+    p.ncut   = 1;
+    pg_flush(&p);
+    pg_size(&p, auto_width);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = pg_signal;   /* no SA_RESTART: read() returns */
+    sigaction(SIGWINCH, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    raw = saved;
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(tty, TCSAFLUSH, &raw);
+    out_puts(o, "\033[?1049h\033[?25l\033[?7l");   /* alt screen, no cursor/wrap */
+
+    const char *name = strcmp(path, "-") == 0 ? "stdin" : path;
+    long        half;
+    while (!g_pg_quit && !o->err) {
+        if (g_pg_winch) {
+            g_pg_winch = 0;
+            pg_size(&p, auto_width);
+            if (auto_width && pg_have(&p, 0)) {
+                /* re-render, keeping the same share of the top chunk */
+                double at = (double)p.row / (double)pg_page(&p, p.top)->nlines;
+                pg_flush(&p);
+                p.row = (size_t)(at * (double)pg_page(&p, p.top)->nlines);
+            }
+        }
+        pg_draw(&p, o, name);
+        half = (p.rows - 1) / 2;
+
+        int key = pg_key(tty);
+        switch (key) {
+        case 'q': case 'Q':
+            g_pg_quit = 1;
+            break;
+        case 'j': case 'e': case '\n': case '\r': case 5: case 14: case PK_DOWN:
+            pg_scroll(&p, 1);
+            break;
+        case 'k': case 'y': case 25: case 16: case PK_UP:
+            pg_scroll(&p, -1);
+            break;
+        case ' ': case 'f': case 6: case 22: case PK_PGDN:
+            pg_scroll(&p, p.rows - 1);
+            break;
+        case 'b': case 2: case PK_PGUP:
+            pg_scroll(&p, -(p.rows - 1));
+            break;
+        case 'd': case 4:
+            pg_scroll(&p, half);
+            break;
+        case 'u': case 21:
+            pg_scroll(&p, -half);
+            break;
+        case 'g': case '<': case PK_HOME:
+            p.top = p.row = 0;
+            break;
+        case 'G': case '>': case PK_END:
+            pg_end(&p);
+            break;
+        }
+    }
+
+    out_puts(o, "\033[?7h\033[?25h\033[?1049l");
+    out_flush(o);
+    tcsetattr(tty, TCSAFLUSH, &saved);
+    close(tty);
+    for (int i = 0; i < PG_CACHE; i++) {
+        free(p.page[i].text);
+        free(p.page[i].line);
+    }
+    free(p.cut);
+    input_close(&in);
+    return 0;
+}
+
+/* ── Render cache (--cache-dir) ──────────────────────────────────────────── */
+/*
+ * Rendered output is kept in the cache directory, one file per (input
+ * bytes, render options) pair, named by a hash of both.  A hit is copied
+ * to stdout with sendfile() and never parsed.  A miss is rendered as
+ * usual, with everything written to stdout also going to a temporary
+ * file that is renamed into place once complete.  When an insert takes
+ * the directory over --cache-size, the least recently used entries (by
+ * mtime, refreshed on every hit) are deleted.  Temporary files count
+ * towards the cap too; those not written to for CACHE_TMP_AGE were left
+ * by a render that was killed and are deleted.  The cap is checked only
+ * after an insert, so the directory can briefly exceed it by the entries
+ * being written.
+ */
+
+#define CACHE_VERSION 8      /* bump whenever the rendered bytes change */
+#define CACHE_TMP_AGE 3600   /* seconds before an idle .tmp.* is stale */
+
+static uint64_t hash_mix(uint64_t h, uint64_t w)
+{
+    h ^= w * 0xBF58476D1CE4E5B9ULL;
+    return (h << 31 | h >> 33) * 0x94D049BB133111EBULL;
+}
+
+/* Fast non-cryptographic hash: four independent lanes of 8-byte words. */
+static uint64_t hash_bytes(const char *s, size_t n, uint64_t seed)
+{
+    uint64_t h[4] = { seed, seed ^ 0x9E3779B97F4A7C15ULL,
+                      seed + 0x632BE59BD9B4E019ULL, ~seed };
+    uint64_t w;
+    size_t   i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        for (int k = 0; k < 4; k++) {
+            memcpy(&w, s + i + 8 * k, 8);
+            h[k] = hash_mix(h[k], w);
+        }
+    uint64_t r = hash_mix(hash_mix(h[0], h[1]), hash_mix(h[2], h[3]));
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, s + i, 8);
+        r = hash_mix(r, w);
+    }
+    w = 0;
+    memcpy(&w, s + i, n - i);
+    r = hash_mix(r, w ^ (uint64_t)n);
+    r ^= r >> 31;
+    return r;
+}
+
+/* write() all of buf, returns 0 or an errno value */
+static int write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buf += w;
+        n   -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Copy the entry `fd` to the output, in the kernel where possible. */
+static void cache_send(Out *o, int fd, off_t size)
+{
+    static char buf[READ_BLOCK];
+
+    out_flush(o);
+    STAT_ADD(o, bytes_out, (uint64_t)size);
+#if defined(HAVE_SENDFILE)
+    while (size > 0 && !o->err) {
+        ssize_t n = sendfile(o->fd, fd, NULL, (size_t)size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;   /* unsupported here: copy the rest */
+        size -= n;
+    }
+#endif
+    while (size > 0 && !o->err) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        o->err = write_all(o->fd, buf, (size_t)n);
+        size  -= n;
+    }
+}
+
+typedef struct {
+    int       out;
+    int       tmp;    /* -1 once writing the entry failed */
+    long long room;   /* an entry larger than the whole cache is not kept */
+} Tee;
+
+static int tee_write(void *user, const char *buf, size_t len)
+{
+    Tee *t = user;
+
+    t->room -= (long long)len;
+    if (t->tmp >= 0 && (t->room < 0 || write_all(t->tmp, buf, len))) {
+        close(t->tmp);
+        t->tmp = -1;
+    }
+    return write_all(t->out, buf, len);
+}
+
+typedef struct {
+    time_t mtime;
+    off_t  size;
+    char   name[64];
+} CacheEntry;
+
+static int entry_older(const void *a, const void *b)
+{
+    time_t x = ((const CacheEntry *)a)->mtime, y = ((const CacheEntry *)b)->mtime;
+    return (x > y) - (x < y);
+}
+
+/* Delete the least recently used entries until the cache fits its cap. */
+static void cache_evict(void)
+{
+    DIR           *dir = opendir(g_cache_dir);
+    struct dirent *de;
+    CacheEntry    *e = NULL;
+    size_t         n = 0, cap = 0;
+    long long      total = 0;
+    char           path[4096];
+    time_t         now = time(NULL);
+
+    if (!dir) return;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        int tmp = strncmp(de->d_name, ".tmp.", 5) == 0;
+        if ((de->d_name[0] == '.' && !tmp) || strlen(de->d_name) >= sizeof e->name)
+            continue;
+        snprintf(path, sizeof path, "%s/%s", g_cache_dir, de->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (tmp) {
+            /* another render's entry in progress, or one killed midway */
+            if (now - st.st_mtime > CACHE_TMP_AGE) unlink(path);
+            else total += st.st_size;
+            continue;
+        }
+        if (n == cap) e = xrealloc(e, (cap = cap ? cap * 2 : 64) * sizeof *e);
+        e[n].mtime = st.st_mtime;
+        e[n].size  = st.st_size;
+        strcpy(e[n].name, de->d_name);
+        total += st.st_size;
+        n++;
+    }
+    closedir(dir);
+
+    if (total > g_cache_max) {
+        qsort(e, n, sizeof *e, entry_older);
+        for (size_t i = 0; i < n && total > g_cache_max; i++) {
+            snprintf(path, sizeof path, "%s/%s", g_cache_dir, e[i].name);
+            if (unlink(path) == 0) total -= e[i].size;
+        }
+    }
+    free(e);
+}
+
+static void render_input(Out *o, const char *data, size_t len);
+
+/* Serve one input from the cache, rendering and storing it on a miss. */
+static void render_cached(Out *o, const char *data, size_t len)
+{
+    uint64_t h = hash_bytes(data, len, CACHE_VERSION);
+    char     path[4096], tmp[4096];
+    int      fd;
+
+    h = hash_mix(h, (uint64_t)g_opts.color);
+    h = hash_mix(h, (uint64_t)g_opts.format);
+    h = hash_mix(h, (uint64_t)g_opts.table_stream);
+    h = hash_mix(h, (uint64_t)g_opts.width);
+    if (g_opts.color)
+        h = hash_mix(h, hash_bytes((const char *)theme_color, sizeof theme_color, 0));
+    snprintf(path, sizeof path, "%s/%016llx-%llx", g_cache_dir,
+             (unsigned long long)h, (unsigned long long)len);
+
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            futimens(fd, NULL);   /* LRU: mark as just used */
+            STAT_ADD(o, bytes_in, len);   /* read and hashed, if not parsed */
+            cache_send(o, fd, st.st_size);
+            close(fd);
+            return;
+        }
+        close(fd);
+    }
+
+    snprintf(tmp, sizeof tmp, "%s/.tmp.XXXXXX", g_cache_dir);
+    Tee t   = { o->fd, mkstemp(tmp), g_cache_max };
+    Out out;
+
+    out_flush(o);
+    out_init(&out, -1, &g_opts);
+    out.write = tee_write;
+    out.user  = &t;
+#if MDCAT_STATS
+    out.stats = o->stats;     /* a miss is still parsed and rendered */
+#endif
+    render_input(&out, data, len);
+    out_flush(&out);
+    out_free(&out);
+    if (out.err) o->err = out.err;
+
+    if (t.tmp < 0) {
+        unlink(tmp);
+        return;
+    }
+    if (close(t.tmp) == 0 && !out.err && rename(tmp, path) == 0) {
+        cache_evict();
+        return;
+    }
+    unlink(tmp);
+}
+
+/* ── Sections and line ranges (--section, --lines) ───────────────────────── */
+/*
+ * Both are answered from an Index of the input: the offsets of headings,
+ * fenced code and tables as the block parser sees them, and of every
+ * IDX_MARK-th line.  Building one costs a parse without rendering; with
+ * --index it is kept in FILE.mdcat-index, next to the input, and reused
+ * while the input's size, mtime and inode are unchanged.  Rendering then
+ * starts at the section or line wanted, which is a clean start for the
+ * parser: a heading ends any table and is never inside fenced code, and
+ * a range that begins inside code or a table is rendered accordingly.
+ * Only top-level blocks are recorded; a line range that begins inside a
+ * quote or list item is rendered without it.
+ */
+
+#define IDX_VERSION 3
+#define IDX_MARK    4096   /* lines between line marks */
+
+/* The nanoseconds of st_mtime, where the platform keeps them */
+#if defined(__APPLE__)
+#define ST_MTIME_NSEC(st) ((st).st_mtimensec)
+#elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+    || defined(__OpenBSD__) || defined(__DragonFly__) || defined(__sun)
+#define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) 0
+#endif
+
+enum { IX_HEADING, IX_FENCE, IX_TABLE };
+
+typedef struct {
+    uint64_t off, end;   /* heading line, or the whole fence or table */
+    uint32_t kind, level;
+} IdxEntry;
+
+typedef struct {
+    char     magic[8];   /* "mdcatidx" */
+    uint32_t version, mark;
+    uint64_t size, mtime, mtime_ns, ino;   /* the input the index is for */
+    uint64_t nent, nmark;
+} IdxHeader;
+
+typedef struct {
+    IdxEntry *ent;
+    size_t    nent, entcap;
+    uint64_t *mark;      /* mark[k]: offset of line 1 + k * IDX_MARK */
+    size_t    nmark, markcap;
+} Index;
+
+static IdxEntry *index_add(Index *ix, int kind, uint64_t off, uint64_t end, int level)
+{
+    if (ix->nent == ix->entcap) {
+        ix->entcap = ix->entcap ? ix->entcap * 2 : 256;
+        ix->ent    = xrealloc(ix->ent, ix->entcap * sizeof *ix->ent);
+    }
+    IdxEntry *e = &ix->ent[ix->nent++];
+    e->off   = off;
+    e->end   = end;
+    e->kind  = (uint32_t)kind;
+    e->level = (uint32_t)level;
+    return e;
+}
+
+/* Record the blocks of `d`; *fence and *table are the open entries, or -1. */
+static void index_doc(Index *ix, const Doc *d, uint64_t size,
+                      long *fence, long *table)
+{
+    for (size_t i = 0; i < d->nblocks; i++) {
+        const Block *b   = &d->blocks[i];
+        uint64_t     end = b->off + b->len + 1 < size ? b->off + b->len + 1 : size;
+
+        if (b->nest) continue;   /* only top-level blocks are restart points */
+        switch (b->kind) {
+        case BK_HEADING:
+            index_add(ix, IX_HEADING, b->off, end, (int)b->level);
+            break;
+        case BK_FENCE_OPEN:
+            index_add(ix, IX_FENCE, b->off, size, 0);
+            *fence = (long)ix->nent - 1;
+            break;
+        case BK_FENCE_CLOSE:
+            if (*fence >= 0 && !b->level) ix->ent[*fence].end = end;
+            *fence = -1;
+            break;
+        case BK_TABLE:
+            index_add(ix, IX_TABLE, b->off, end, 0);
+            *table = (long)ix->nent - 1;
+            break;
+        case BK_TABLE_ROW:
+            if (*table >= 0) ix->ent[*table].end = end;
+            break;
+        case BK_TABLE_END:
+            *table = -1;
+            break;
+        }
+    }
+}
+
+static void index_build(Index *ix, const char *buf, size_t size)
+{
+    const char *pos = buf;
+    const char *end = buf + size;
+    const char *line;
+    size_t      len;
+    Doc         doc = { 0 };
+    Parser      p   = { 0 };
+    long        fence = -1, table = -1;
+
+    memset(ix, 0, sizeof *ix);
+    doc.src  = buf;
+    p.doc    = &doc;
+    p.stream = -1;
+    while (next_line(&pos, end, &line, &len)) {
+        if (len > IR_LINE_MAX) { pos = line + IR_LINE_MAX; len = IR_LINE_MAX; }
+        parse_line(&p, line, len);
+        if (doc.nblocks >= BATCH_BLOCKS && parser_idle(&p)) {
+            index_doc(ix, &doc, size, &fence, &table);
+            parser_reset(&p);
+        }
+    }
+    parse_finish(&p);
+    index_doc(ix, &doc, size, &fence, &table);
+    doc_free(&doc);
+
+    uint64_t lines = 0;
+    for (pos = buf; ; pos++) {
+        if (lines % IDX_MARK == 0) {
+            if (ix->nmark == ix->markcap) {
+                ix->markcap = ix->markcap ? ix->markcap * 2 : 256;
+                ix->mark    = xrealloc(ix->mark, ix->markcap * sizeof *ix->mark);
+            }
+            ix->mark[ix->nmark++] = (uint64_t)(pos - buf);
+        }
+        lines++;
+        if (!(pos = memchr(pos, '\n', (size_t)(end - pos)))) break;
+    }
+}
+
+/* Fill `h` with the fingerprint of `path`; returns 0 or -1 */
+static int index_key(const char *path, IdxHeader *h)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, "mdcatidx", 8);
+    h->version  = IDX_VERSION;
+    h->mark     = IDX_MARK;
+    h->size     = (uint64_t)st.st_size;
+    h->mtime    = (uint64_t)st.st_mtime;
+    h->mtime_ns = (uint64_t)ST_MTIME_NSEC(st);   /* same-second rewrites */
+    h->ino      = (uint64_t)st.st_ino;
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+/*
+ * Whether a loaded index only points into an input of `size` bytes.  The
+ * sidecar is a cache on disk like any other file, so its offsets are
+ * checked before anything is read at them.
+ */
+static int index_sane(const Index *ix, uint64_t size)
+{
+    uint64_t last = 0;
+
+    for (size_t i = 0; i < ix->nent; i++) {
+        const IdxEntry *e = &ix->ent[i];
+        if (e->off < last || e->off > e->end || e->end > size) return 0;
+        last = e->off;
+    }
+    if (ix->mark[0] != 0) return 0;
+    for (size_t k = 1; k < ix->nmark; k++)
+        if (ix->mark[k] < ix->mark[k - 1] || ix->mark[k] > size) return 0;
+    return 1;
+}
+
+/* Load the sidecar index of `path` if it is still that of `key`. */
+static int index_load(Index *ix, const char *file, const IdxHeader *key)
+{
+    IdxHeader h;
+    int       fd = open(file, O_RDONLY);
+
+    memset(ix, 0, sizeof *ix);
+    if (fd < 0) return -1;
+    if (read_all(fd, &h, sizeof h) < 0
+        || memcmp(&h, key, offsetof(IdxHeader, nent)) != 0
+        || h.nmark == 0 || h.nent > h.size || h.nmark > h.size / IDX_MARK + 1) {
+        close(fd);
+        return -1;
+    }
+    ix->nent  = ix->entcap  = (size_t)h.nent;
+    ix->nmark = ix->markcap = (size_t)h.nmark;
+    ix->ent   = xrealloc(NULL, ix->nent * sizeof *ix->ent);
+    ix->mark  = xrealloc(NULL, ix->nmark * sizeof *ix->mark);
+    int err = read_all(fd, ix->ent, ix->nent * sizeof *ix->ent) < 0
+           || read_all(fd, ix->mark, ix->nmark * sizeof *ix->mark) < 0;
+    close(fd);
+    if (err || !index_sane(ix, h.size)) {
+        free(ix->ent);
+        free(ix->mark);
+        memset(ix, 0, sizeof *ix);
+        return -1;
+    }
+    return 0;
+}
+
+/* Store the index next to its input; failing to is not an error. */
+static void index_save(const Index *ix, const char *file, const IdxHeader *key)
+{
+    char      tmp[4096];
+    IdxHeader h = *key;
+    int       fd;
+
+    if ((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= sizeof tmp
+        || (fd = mkstemp(tmp)) < 0)
+        return;
+    h.nent  = ix->nent;
+    h.nmark = ix->nmark;
+    if (write_all(fd, (const char *)&h, sizeof h)
+        || write_all(fd, (const char *)ix->ent, ix->nent * sizeof *ix->ent)
+        || write_all(fd, (const char *)ix->mark, ix->nmark * sizeof *ix->mark)
+        || close(fd) < 0
+        || rename(tmp, file) < 0)
+        unlink(tmp);
+}
+
+/* Offset of line n (1-based) of buf, or size past the last line */
+static size_t line_offset(const Index *ix, const char *buf, size_t size, long n)
+{
+    size_t k = (size_t)(n - 1) / IDX_MARK;
+    if (k >= ix->nmark) k = ix->nmark - 1;
+
+    const char *pos  = buf + ix->mark[k];
+    long        skip = n - 1 - (long)(k * IDX_MARK);
+    while (skip-- > 0 && pos) {
+        pos = memchr(pos, '\n', (size_t)(buf + size - pos));
+        if (pos) pos++;
+    }
+    return pos ? (size_t)(pos - buf) : size;
+}
+
+/* Whether heading line [s, s+n) is `want` ("Title" or "## Title") */
+static int heading_is(const char *s, size_t n, const char *want)
+{
+    while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r' || s[n - 1] == '\n'))
+        n--;
+    if (want[0] != '#') {
+        while (n > 0 && *s == '#') { s++; n--; }
+        while (n > 0 && (*s == ' ' || *s == '\t')) { s++; n--; }
+    }
+    /* Emphasis and code delimiters do not count on either side */
+    for (const char *e = s + n;; s++, want++) {
+        while (s < e && (*s == '*' || *s == '_' || *s == '`')) s++;
+        while (*want == '*' || *want == '_' || *want == '`') want++;
+        if (s == e || !*want) return s == e && !*want;
+        if (*s != *want) return 0;
+    }
+}
+
+/* Parse --lines=A-B (or A, or A- for the rest).  Returns 0 or -1. */
+static int parse_range(const char *s, long *from, long *to)
+{
+    char *e;
+
+    *from = strtol(s, &e, 10);
+    if (e == s || *from < 1) return -1;
+    if (*e == '\0') { *to = *from; return 0; }
+    if (*e++ != '-') return -1;
+    if (*e == '\0') { *to = 0; return 0; }
+    s   = e;
+    *to = strtol(s, &e, 10);
+    return e == s || *e != '\0' || *to < *from ? -1 : 0;
+}
+
+/* Render the --section or --lines part of one input */
+static int render_extract(Out *o, const char *path, const Input *in)
+{
+    Index       ix;
+    IdxHeader   key;
+    char        file[4096];
+    int         have = 0, rc = 0;
+    const char *name = strcmp(path, "-") == 0 ? "stdin" : path;
+
+    if (g_index && strcmp(path, "-") != 0 && index_key(path, &key) == 0
+        && key.size == in->len
+        && (size_t)snprintf(file, sizeof file, "%s.mdcat-index", path) < sizeof file) {
+        have = index_load(&ix, file, &key) == 0;
+        if (!have) {
+            index_build(&ix, in->data, in->len);
+            index_save(&ix, file, &key);
+            have = 1;
+        }
+    }
+    if (!have) index_build(&ix, in->data, in->len);
+
+    if (g_section) {
+        size_t i = 0, j;
+        for (; i < ix.nent; i++)
+            if (ix.ent[i].kind == IX_HEADING
+                && heading_is(in->data + ix.ent[i].off,
+                              (size_t)(ix.ent[i].end - ix.ent[i].off), g_section))
+                break;
+        if (i == ix.nent) {
+            fprintf(stderr, "mdcat: %s: no section '%s'\n", name, g_section);
+            rc = 1;
+        } else {
+            for (j = i + 1; j < ix.nent; j++)
+                if (ix.ent[j].kind == IX_HEADING && ix.ent[j].level <= ix.ent[i].level)
+                    break;
+            size_t start = (size_t)ix.ent[i].off;
+            size_t stop  = j < ix.nent ? (size_t)ix.ent[j].off : in->len;
+            render_part(o, &g_opts, in->data + start, stop - start, 0);
+        }
+    } else {
+        size_t start = line_offset(&ix, in->data, in->len, g_line_from);
+        size_t stop  = g_line_to ? line_offset(&ix, in->data, in->len, g_line_to + 1)
+                                 : in->len;
+        int    in_fence = 0;
+        for (size_t i = 0; i < ix.nent && ix.ent[i].off < start; i++) {
+            if (start >= ix.ent[i].end) continue;
+            if (ix.ent[i].kind == IX_FENCE) in_fence = 1;
+            if (ix.ent[i].kind == IX_TABLE) start = (size_t)ix.ent[i].off;   /* from its header */
+        }
+        if (start < stop) render_part(o, &g_opts, in->data + start, stop - start, in_fence);
+    }
+    free(ix.ent);
+    free(ix.mark);
+    return rc;
+}
+
+/* ── Server mode (--serve) ───────────────────────────────────────────────── */
+/*
+ * One long-lived process renders a stream of documents, so a caller that
+ * would otherwise start mdcat for each one pays for startup once.  A
+ * request is the document's length in decimal and a newline, followed by
+ * that many bytes, and the response is framed the same way:
+ *
+ *     14\n# Hello *you*\n   ->   51\n<the heading, 51 bytes>
+ *
+ * Requests may be pipelined.  Each document is rendered from a clean state
+ * with the command line's options, exactly as `mdcat --width=N < doc |`
+ * would render it; only the connection's buffers are kept, so a warm server
+ * allocates nothing for documents no larger than earlier ones.
+ *
+ * Without a path the requests come on stdin and the responses go to
+ * stdout.  --serve=PATH listens on a Unix socket there instead, and -j N
+ * threads each accept and serve one connection at a time.
+ */
+
+#define SERVE_MAX (1u << 30)   /* largest document accepted */
+#define SERVE_HDR 16           /* room kept for a response header */
+#define SERVE_BUF (64 * 1024)
+
+typedef struct {
+    int    in, out;        /* request and response descriptors */
+    char  *buf;            /* bytes read; buf[pos..len) not yet served */
+    size_t pos, len, cap;
+    Out    o;              /* memory sink, SERVE_HDR bytes free in front */
+    int    err;            /* errno of a failed response write */
+} Conn;
+
+static void conn_init(Conn *c, int in, int out)
+{
+    memset(c, 0, sizeof *c);
+    c->in  = in;
+    c->out = out;
+    out_init(&c->o, -1, &g_opts);
+}
+
+static void conn_free(Conn *c)
+{
+    free(c->buf);
+    out_free(&c->o);
+}
+
+/* Buffer `need` unserved bytes.  Returns 0 if the input ends first. */
+static int conn_fill(Conn *c, size_t need)
+{
+    if (c->pos + need > c->cap) {
+        if (c->pos) {
+            memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+            c->len -= c->pos;
+            c->pos  = 0;
+        }
+        if (need > c->cap) {
+            size_t cap = c->cap ? c->cap : SERVE_BUF;
+            while (cap < need) cap *= 2;
+            c->buf = xrealloc(c->buf, cap);
+            c->cap = cap;
+        }
+    }
+    while (c->len - c->pos < need) {
+        ssize_t n = read(c->in, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        c->len += (size_t)n;
+    }
+    return 1;
+}
+
+/*
+ * Answer requests until the input ends.  Returns 0 then, or -1 after a
+ * malformed or truncated request or a failed write (c->err set).
+ */
+static int serve_conn(Conn *c)
+{
+    for (;;) {
+        size_t   hdr  = 0;   /* header bytes, newline included */
+        uint64_t size = 0;
+        for (;;) {
+            if (!conn_fill(c, hdr + 1)) return hdr ? -1 : 0;
+            char ch = c->buf[c->pos + hdr++];
+            if (ch == '\n' && hdr > 1) break;
+            if (ch < '0' || ch > '9' || hdr > 10) return -1;
+            size = size * 10 + (uint64_t)(ch - '0');
+        }
+        if (size > SERVE_MAX || !conn_fill(c, hdr + (size_t)size)) return -1;
+
+        c->o.len = SERVE_HDR;
+        render_file(&c->o, &g_opts, c->buf + c->pos + hdr, (size_t)size);
+        c->pos += hdr + (size_t)size;
+
+        char   num[SERVE_HDR];
+        size_t n   = (size_t)snprintf(num, sizeof num, "%zu\n", c->o.len - SERVE_HDR);
+        char  *res = c->o.buf + SERVE_HDR - n;
+        memcpy(res, num, n);
+        c->err = write_all(c->out, res, c->o.len - SERVE_HDR + n);
+        if (c->err) return -1;
+    }
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un sa;
+    struct stat        st;
+    size_t             n = strlen(path);
+
+    if (n >= sizeof sa.sun_path) { errno = ENAMETOOLONG; return -1; }
+    memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path, n + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);   /* stale */
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void *serve_worker(void *arg)
+{
+    int  lfd = *(const int *)arg;
+    Conn c;
+
+    conn_init(&c, -1, -1);
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {   /* wait for a close */
+                struct timespec ts = { 0, 10 * 1000000L };
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            perror("mdcat: accept");
+            break;
+        }
+        c.in  = c.out = fd;
+        c.pos = c.len = 0;
+        serve_conn(&c);   /* a bad request just ends its connection */
+        close(fd);
+    }
+    conn_free(&c);
+    return NULL;
+}
+
+/* --serve[=PATH].  Returns the exit status. */
+static int serve(const char *path)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_IGN;   /* a client that hangs up is a write error */
+    sigaction(SIGPIPE, &sa, NULL);
+
+    if (!path) {
+        Conn c;
+        conn_init(&c, STDIN_FILENO, STDOUT_FILENO);
+        int rc = serve_conn(&c);
+        if (rc < 0 && c.err) {
+            errno = c.err;
+            perror("mdcat: write error");
+        } else if (rc < 0) {
+            fputs("mdcat: malformed or truncated request\n", stderr);
+        }
+        conn_free(&c);
+        return rc < 0;
+    }
+
+    int lfd = serve_listen(path);
+    if (lfd < 0) {
+        fprintf(stderr, "mdcat: cannot listen on '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    pthread_t tid[PAR_THREADS];
+    long      nthreads = g_jobs < PAR_THREADS ? g_jobs : PAR_THREADS;
+    long      started  = 0;
+    while (started < nthreads - 1
+           && pthread_create(&tid[started], NULL, serve_worker, &lfd) == 0)
+        started++;
+    serve_worker(&lfd);
+    for (long i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    close(lfd);
+    return 1;
+}
+
+/* ── Entry point ─────────────────────────────────────────────────────────── */
+
+/* Set the flush policy of stdout's Out for what it is (see Output sink) */
+static void out_adapt(Out *o)
+{
+    struct stat st;
+
+    if (isatty(o->fd)) {
+        o->flush_at = TTY_FLUSH;
+        o->flush_ms = TTY_FLUSH_MS;
+    } else if (fstat(o->fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode))) {
+        free(o->buf);   /* still empty */
+        o->cap = PIPE_CAP;
+        o->buf = xrealloc(NULL, o->cap);
+    }
+}
+
+#if MDCAT_STATS
+#define USAGE_STATS " [--stats]"
+#else
+#define USAGE_STATS ""
+#endif
+
+static void usage(void)
+{
+    fputs("usage: mdcat [-j N] [--width=N] [--table-stream=N] [--theme=FILE]" USAGE_STATS "\n"
+          "             [--cache-dir=DIR [--cache-size=MB]] [file ...]\n"
+          "       mdcat -f [--width=N] [--table-stream=N] file\n"
+          "       mdcat --pager [--width=N] [--theme=FILE] [file]\n"
+          "       mdcat (--section=TEXT | --lines=A-B) [--index] [file ...]\n"
+          "       mdcat --serve[=SOCKET] [-j N] [--width=N] [--table-stream=N]\n"
+          "  --format=ansi|plain|html|json picks the output; --also-html=FILE adds HTML\n"
+          "  --no-style-in-fences prints code blocks without colours\n", stderr);
+    exit(2);
+}
+
+static void render_input(Out *o, const char *data, size_t len)
+{
+    /* JSON's commas span chunks, and chunk workers have no second output */
+    if (g_jobs > 1 && len > PAR_CHUNK && o->format != MDCAT_JSON && !o->also)
+        render_parallel(o, data, len);
+    else
+        render_file(o, &g_opts, data, len);
+}
+
+/* Render one input ("-" is stdin).  Returns 0, or 1 after reporting an error. */
+static int render_path(Out *o, const char *path)
+{
+    Input in;
+    int   err = load_path(path, &in);
+
+    if (err) {
+        open_error(path, err);
+        return 1;
+    }
+    int rc = 0;
+    if (g_section || g_line_from)     rc = render_extract(o, path, &in);
+    else if (g_cache_dir && !o->also) render_cached(o, in.data, in.len);
+    else                              render_input(o, in.data, in.len);
+    input_close(&in);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    Out  out;
+    int  argi;
+    long width = -1;   /* --width=N; -1: the terminal's */
+
+    for (argi = 1; argi < argc; argi++) {
+        const char *a = argv[argi];
+        if (strcmp(a, "--") == 0) { argi++; break; }
+        if (a[0] != '-' || a[1] == '\0') break;
+
+        if (strcmp(a, "-f") == 0) {
+            g_follow = 1;
+        } else if (strcmp(a, "--pager") == 0) {
+            g_pager = 1;
+        } else if (strncmp(a, "--format=", 9) == 0) {
+            const char *f = a + 9;
+            if      (strcmp(f, "ansi") == 0)  g_color = 1;
+            else if (strcmp(f, "plain") == 0) g_color = 0;
+            else if (strcmp(f, "html") == 0)  g_opts.format = MDCAT_HTML;
+            else if (strcmp(f, "json") == 0)  g_opts.format = MDCAT_JSON;
+            else {
+                fprintf(stderr, "mdcat: unknown format '%s'\n", f);
+                return 2;
+            }
+        } else if (strncmp(a, "--also-html=", 12) == 0 && a[12]) {
+            g_also_html = a + 12;
+        } else if (strcmp(a, "--serve") == 0) {
+            g_serve = 1;
+        } else if (strncmp(a, "--serve=", 8) == 0 && a[8]) {
+            g_serve  = 1;
+            g_socket = a + 8;
+        } else if (strncmp(a, "--section=", 10) == 0 && a[10]) {
+            g_section = a + 10;
+        } else if (strncmp(a, "--lines=", 8) == 0) {
+            if (parse_range(a + 8, &g_line_from, &g_line_to) < 0) {
+                fprintf(stderr, "mdcat: invalid line range '%s'\n", a + 8);
+                return 2;
+            }
+        } else if (strcmp(a, "--index") == 0) {
+            g_index = 1;
+        } else if (strncmp(a, "-j", 2) == 0) {
+            const char *n = a[2] ? a + 2 : (argi + 1 < argc ? argv[++argi] : "");
+            char *e;
+            g_jobs = strtol(n, &e, 10);
+            if (e == n || *e != '\0' || g_jobs < 1) {
+                fprintf(stderr, "mdcat: invalid job count '%s'\n", n);
+                return 2;
+            }
+        } else if (strncmp(a, "--table-stream=", 15) == 0) {
+            char *e;
+            g_opts.table_stream = strtol(a + 15, &e, 10);
+            if (e == a + 15 || *e != '\0' || g_opts.table_stream < 0) {
+                fprintf(stderr, "mdcat: invalid row count '%s'\n", a + 15);
+                return 2;
+            }
+        } else if (strncmp(a, "--width=", 8) == 0) {
+            char *e;
+            width = strtol(a + 8, &e, 10);
+            if (e == a + 8 || *e != '\0' || width < 0 || width > 100000) {
+                fprintf(stderr, "mdcat: invalid width '%s'\n", a + 8);
+                return 2;
+            }
+#if MDCAT_STATS
+        } else if (strcmp(a, "--stats") == 0) {
+            g_want_stats = 1;
+#endif
+        } else if (strncmp(a, "--theme=", 8) == 0 && a[8]) {
+            theme_load(a + 8);
+        } else if (strcmp(a, "--no-style-in-fences") == 0) {
+            g_plain_fences = 1;
+        } else if (strncmp(a, "--cache-dir=", 12) == 0 && a[12]) {
+            g_cache_dir = a + 12;
+        } else if (strncmp(a, "--cache-size=", 13) == 0) {
+            char *e;
+            long mb = strtol(a + 13, &e, 10);
+            if (e == a + 13 || *e != '\0' || mb < 0) {
+                fprintf(stderr, "mdcat: invalid cache size '%s'\n", a + 13);
+                return 2;
+            }
+            g_cache_max = (long long)mb << 20;
+        } else {
+            fprintf(stderr, "mdcat: unknown option '%s'\n", a);
+            usage();
+        }
+    }
+
+    if (g_follow && argc - argi != 1) {
+        fputs("mdcat: -f needs exactly one file\n", stderr);
+        usage();
+    }
+    if (g_section && g_line_from) {
+        fputs("mdcat: --section and --lines exclude each other\n", stderr);
+        usage();
+    }
+    if (g_pager && argc - argi > 1) {
+        fputs("mdcat: --pager takes one file\n", stderr);
+        usage();
+    }
+    if (g_serve && (argc - argi > 0 || g_follow || g_pager || g_section || g_line_from)) {
+        fputs("mdcat: --serve takes its documents as requests\n", stderr);
+        usage();
+    }
+    if (g_also_html && (g_serve || g_pager)) {
+        fputs("mdcat: --also-html needs a single output stream\n", stderr);
+        usage();
+    }
+
+    if (g_cache_dir && mkdir(g_cache_dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "mdcat: cannot use cache '%s': %s\n", g_cache_dir,
+                strerror(errno));
+        g_cache_dir = NULL;
+    }
+
+    g_opts.color = g_color >= 0 ? g_color : !g_serve && isatty(STDOUT_FILENO);
+    int auto_width = width < 0;
+    if (width < 0) {
+        struct winsize ws;
+        width = !g_serve && isatty(STDOUT_FILENO)
+                && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 ? ws.ws_col : 0;
+    }
+    g_opts.width = (int)width;
+    scan_init();
+    if (g_plain_fences) theme_plain_fences();
+    out_init(&out, STDOUT_FILENO, &g_opts);
+    out_adapt(&out);
+#if MDCAT_STATS
+    if (g_want_stats) out.stats = &g_stats;
+#endif
+    Out html;
+    if (g_also_html) {
+        mdcat_options h = g_opts;
+        int fd = open(g_also_html, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "mdcat: cannot write '%s': %s\n", g_also_html, strerror(errno));
+            return 1;
+        }
+        h.format = MDCAT_HTML;
+        out_init(&html, fd, &h);
+        out.also = &html;
+    }
+
+    int rc = 0;
+    if (g_serve) {
+        rc = serve(g_socket);
+    } else if (g_follow) {
+        rc = follow_path(&out, argv[argi]);
+    } else if (g_pager && g_opts.format == MDCAT_TERMINAL && isatty(STDOUT_FILENO)) {
+        /* not paging into a pipe, even with --format=ansi */
+        rc = page_path(&out, argi < argc ? argv[argi] : "-", auto_width);
+    } else if (argi == argc) {
+        rc = render_path(&out, "-");
+    } else if (g_jobs > 1 && argc - argi > 1 && !g_cache_dir
+               && !g_section && !g_line_from && !g_also_html) {
+        rc = render_files_parallel(&out, argv + argi, (size_t)(argc - argi));
+    } else {
+        for (int i = argi; i < argc && rc == 0; i++)
+            rc = render_path(&out, argv[i]);
+    }
+
+    out_flush(&out);
+    out_free(&out);
+    if (g_also_html) {
+        out_flush(&html);
+        if (close(html.fd) < 0 && !html.err) html.err = errno;
+        out_free(&html);
+        if (html.err) {
+            fprintf(stderr, "mdcat: cannot write '%s': %s\n", g_also_html,
+                    strerror(html.err));
+            rc = 1;
+        }
+    }
+#if MDCAT_STATS
+    if (g_want_stats) stats_print(&g_stats);
+#endif
+    if (out.err) {
+        errno = out.err;
+        perror("mdcat: write error");
+        return 1;
+    }
+    return rc;
+}
+
+#endif /* !MDCAT_LIB */
@@ -0,0 +1,58 @@
+/*
+ * mdcat.h — libmdcat, the mdcat renderer as a streaming library
+ *
+ * Markdown is pushed in as it arrives, in pieces of any size, and the
+ * rendered bytes come out through a write callback:
+ *
+ *     mdcat_ctx *ctx = mdcat_new(NULL, my_write, my_state);
+ *     while ((n = read(fd, buf, sizeof buf)) > 0)
+ *         mdcat_feed(ctx, buf, n);
+ *     mdcat_finish(ctx);
+ *     mdcat_free(ctx);
+ *
+ * A context holds all rendering state and nothing is global, so any
+ * number of contexts may run on different threads without locking; a
+ * single context must not be used by two threads at once.  Output for a
+ * block is written once the block is complete, so a paragraph appears
+ * when it ends and a table when it ends unless table_stream is set.
+ *
+ * Like the command-line tool, the library exits the process with a
+ * message when memory runs out.
+ *
+ * Build: make libmdcat.a, link with -pthread.
+ */
+
+#ifndef MDCAT_H
+#define MDCAT_H
+
+#include <stddef.h>
+
+/* Receives rendered bytes.  A non-zero return stops output and is
+ * returned from the mdcat_feed()/mdcat_finish() call it happened in. */
+typedef int (*mdcat_write_fn)(void *user, const char *buf, size_t len);
+
+enum { MDCAT_TERMINAL, MDCAT_HTML, MDCAT_JSON };   /* mdcat_options.format */
+
+typedef struct {
+    int  color;          /* emit ANSI escape sequences */
+    long table_stream;   /* as --table-stream=N; -1 sizes tables from all rows */
+    int  width;          /* reflow text to this many columns; 0 keeps lines */
+    int  format;         /* MDCAT_HTML (a fragment) and MDCAT_JSON (a syntax
+                            tree) ignore color and width */
+} mdcat_options;
+
+typedef struct mdcat_ctx mdcat_ctx;
+
+/* NULL options mean terminal output, colour on, tables buffered, no reflow. */
+mdcat_ctx *mdcat_new(const mdcat_options *opt, mdcat_write_fn write, void *user);
+
+/* Render what `buf` completes.  Returns 0 or the write callback's error. */
+int mdcat_feed(mdcat_ctx *ctx, const char *buf, size_t len);
+
+/* End of document: render the rest and make the context ready for the
+ * next one.  Returns 0 or the write callback's error. */
+int mdcat_finish(mdcat_ctx *ctx);
+
+void mdcat_free(mdcat_ctx *ctx);
+
+#endif /* MDCAT_H */
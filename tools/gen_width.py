@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""
+gen_width.py — generate width_table.h, the display-width table for mdcat
+
+Usage: tools/gen_width.py > width_table.h      (or: make width-table)
+
+Widths come from Python's unicodedata, so the table follows the Unicode
+version of the Python that runs this:
+  0  nonspacing and enclosing marks (Mn, Me), format characters (Cf)
+     except U+00AD and the prepended concatenation marks, Hangul
+     medial/final jamo U+1160..U+11FF and U+D7B0..U+D7FF, U+200B
+  2  East Asian Wide and Fullwidth (W, F), which since Unicode 9 includes
+     every Emoji_Presentation character, plus the unassigned CJK planes
+     U+20000..U+3FFFD
+  1  everything else
+The table is two-stage: a block index per 256 codepoints and, per distinct
+block, 64 bytes holding 2-bit widths.
+"""
+
+import sys
+import unicodedata
+
+BLOCK = 256
+
+# Cf characters with a visible glyph (PropList Prepended_Concatenation_Mark)
+PREPENDED = {0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605, 0x06DD, 0x070F,
+             0x0890, 0x0891, 0x08E2, 0x110BD, 0x110CD}
+
+
+def width(cp):
+    if 0x20000 <= cp <= 0x3FFFD:
+        return 2
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cp == 0x00AD or cp in PREPENDED:
+        return 1
+    if (cat in ("Mn", "Me", "Cf") or 0x1160 <= cp <= 0x11FF
+            or 0xD7B0 <= cp <= 0xD7FF or cp == 0x200B):
+        return 0
+    if unicodedata.east_asian_width(c) in ("W", "F"):
+        return 2
+    return 1
+
+
+def main():
+    blocks, index = [], []
+    seen = {}
+    for base in range(0, 0x110000, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= width(base + i) << (2 * (i % 4))
+        key = bytes(packed)
+        if key not in seen:
+            seen[key] = len(blocks)
+            blocks.append(key)
+        index.append(seen[key])
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write("/* Generated by tools/gen_width.py from Unicode %s.  Do not edit. */\n\n"
+              % unicodedata.unidata_version)
+    out.write("static const unsigned char width_index[%d] = {\n" % len(index))
+    for i in range(0, len(index), 16):
+        out.write("    " + ",".join("%3d" % v for v in index[i:i + 16]) + ",\n")
+    out.write("};\n\n")
+    out.write("static const unsigned char width_blocks[%d][%d] = {\n"
+              % (len(blocks), BLOCK // 4))
+    for b in blocks:
+        out.write("    {")
+        for i in range(0, len(b), 16):
+            out.write("\n        " + ",".join("0x%02x" % v for v in b[i:i + 16]) + ",")
+        out.write("\n    },\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()